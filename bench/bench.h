@@ -0,0 +1,63 @@
+/*  Copyright (C) 2008-2009  Ksplice, Inc.
+ *  Authors: Anders Kaseorg, Tim Abbott, Jeff Arnold
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License, version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street - Fifth Floor, Boston, MA
+ *  02110-1301, USA.
+ */
+
+/* Userspace stand-ins for the kernel tables that the generated benchmark
+ * objects contain, laid out as on x86 with CONFIG_GENERIC_BUG.
+ */
+
+struct exception_table_entry {
+	unsigned long insn, fixup;
+};
+
+struct bug_entry {
+	unsigned long bug_addr;
+	const char *file;
+	unsigned short line;
+	unsigned short flags;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_HAVE_TABLES 1
+
+#ifdef __x86_64__
+#define BENCH_PTR ".quad"
+#else
+#define BENCH_PTR ".long"
+#endif
+
+/* A faulting instruction with an __ex_table entry and a .fixup stub */
+#define BENCH_EXTABLE()							\
+	asm volatile("1:\tnop\n"					\
+		     ".section .fixup,\"ax\"\n"				\
+		     "2:\tjmp 1b\n"					\
+		     ".previous\n"					\
+		     ".section __ex_table,\"a\"\n"			\
+		     "\t.balign 8\n"					\
+		     "\t" BENCH_PTR " 1b, 2b\n"				\
+		     ".previous\n")
+
+/* A BUG() site with its __bug_table entry */
+#define BENCH_BUG()							\
+	asm volatile("1:\tud2\n"					\
+		     ".section __bug_table,\"a\"\n"			\
+		     "2:\t" BENCH_PTR " 1b, %c0\n"			\
+		     "\t.word %c1, 0\n"					\
+		     "\t.org 2b+%c2\n"					\
+		     ".previous\n"					\
+		     : : "i" (__FILE__), "i" (__LINE__ & 0xffff),	\
+		     "i" (sizeof(struct bug_entry)))
+#endif /* __x86_64__ || __i386__ */
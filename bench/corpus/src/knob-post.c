@@ -0,0 +1,132 @@
+/* A kernel-style table of tunables written through a proc-like handler
+ * that parses a user buffer, with a function pointer table and the
+ * __ex_table and __bug_table entries of user copies and BUG() checks.
+ * knob-post.c is a typical security update: it bounds the knob index
+ * taken from the user and stops a negative value from passing the
+ * range check. */
+
+#include "../../bench.h"
+
+#define KNOB_BUF 32
+#define EFAULT 14
+#define EINVAL 22
+#define ERANGE 34
+
+struct knob {
+	const char *name;
+	long value, min, max;
+	int (*set)(struct knob *k, long value);
+};
+
+extern int printk(const char *fmt, ...);
+extern unsigned long copy_from_user(void *to, const void *from,
+				    unsigned long n);
+extern void mutex_lock(void *lock);
+extern void mutex_unlock(void *lock);
+
+static int knob_mutex;
+int knob_changes;
+
+static int check_user(void)
+{
+#ifdef BENCH_HAVE_TABLES
+	BENCH_EXTABLE();
+#endif
+	return 0;
+}
+
+static int set_plain(struct knob *k, long value)
+{
+	k->value = value;
+	return 0;
+}
+
+static int set_pow2(struct knob *k, long value)
+{
+	if (value & (value - 1))
+		return -EINVAL;
+	k->value = value;
+	return 0;
+}
+
+static int set_logged(struct knob *k, long value)
+{
+	printk("knob %s: %ld -> %ld\n", k->name, k->value, value);
+	k->value = value;
+	return 0;
+}
+
+static struct knob knobs[] = {
+	{ "batch", 64, 1, 4096, set_pow2 },
+	{ "timeout", 30, 0, 3600, set_plain },
+	{ "retries", 3, 0, 16, set_plain },
+	{ "verbose", 0, 0, 2, set_logged },
+};
+
+static int parse_long(const char *s, long *out)
+{
+	long v = 0;
+	int neg = 0;
+	if (*s == '-') {
+		neg = 1;
+		s++;
+	}
+	if (*s < '0' || *s > '9')
+		return -EINVAL;
+	while (*s >= '0' && *s <= '9')
+		v = v * 10 + (*s++ - '0');
+	if (*s != '\0' && *s != '\n')
+		return -EINVAL;
+	*out = neg ? -v : v;
+	return 0;
+}
+
+#define NR_KNOBS ((int)(sizeof(knobs) / sizeof(knobs[0])))
+
+long knob_get(int idx)
+{
+	if (idx < 0 || idx >= NR_KNOBS)
+		return -EINVAL;
+	return knobs[idx].value;
+}
+
+int knob_write(int idx, const char *ubuf, unsigned long len)
+{
+	char buf[KNOB_BUF];
+	struct knob *k;
+	long value;
+	int ret;
+
+	if (idx < 0 || idx >= NR_KNOBS || len >= sizeof(buf))
+		return -EINVAL;
+	if (check_user() || copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	ret = parse_long(buf, &value);
+	if (ret)
+		return ret;
+
+	k = &knobs[idx];
+	if (value < k->min || value > k->max)
+		return -ERANGE;
+	mutex_lock(&knob_mutex);
+	ret = k->set(k, value);
+	if (ret == 0)
+		knob_changes++;
+	mutex_unlock(&knob_mutex);
+	return ret ? ret : (int)len;
+}
+
+void knob_reset(void)
+{
+	unsigned int i;
+	mutex_lock(&knob_mutex);
+	for (i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++) {
+#ifdef BENCH_HAVE_TABLES
+		if (knobs[i].set == 0)
+			BENCH_BUG();
+#endif
+		knobs[i].value = knobs[i].min;
+	}
+	mutex_unlock(&knob_mutex);
+}
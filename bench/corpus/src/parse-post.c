@@ -0,0 +1,168 @@
+/* Kernel-style option parsing: number conversion, a table of named
+ * handlers and a switch that gcc turns into a jump table, so the object
+ * has function pointer tables and .rodata relocations into .text.
+ * parse-post.c fixes the overflow check in parse_ulong and changes one
+ * table entry. */
+
+#include "../../bench.h"
+
+#define EINVAL 22
+#define ERANGE 34
+#define ULONG_MAX (~0UL)
+
+extern int printk(const char *fmt, ...);
+extern int strcmp(const char *a, const char *b);
+extern unsigned long strlen(const char *s);
+extern char *strchr(const char *s, int c);
+
+struct option_handler {
+	const char *name;
+	int (*set)(const char *val);
+	unsigned long min, max;
+};
+
+static unsigned long opt_timeout = 30, opt_retries = 3, opt_bufsize = 4096;
+static int opt_verbose;
+static char opt_mode[16] = "auto";
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int parse_ulong(const char *s, unsigned int base, unsigned long *res)
+{
+	unsigned long acc = 0;
+	int d;
+	if (base == 0) {
+		base = 10;
+		if (s[0] == '0') {
+			base = 8;
+			if (s[1] == 'x' || s[1] == 'X') {
+				base = 16;
+				s += 2;
+			}
+		}
+	}
+	if (*s == '\0')
+		return -EINVAL;
+	for (; *s != '\0' && *s != '\n'; s++) {
+		d = hexval(*s);
+		if (d < 0 || d >= (int)base)
+			return -EINVAL;
+		if (acc > (ULONG_MAX - d) / base)
+			return -ERANGE;
+		acc = acc * base + d;
+	}
+	*res = acc;
+	return 0;
+}
+
+static int set_ulong(const char *val, unsigned long *opt, unsigned long min,
+		     unsigned long max)
+{
+	unsigned long v;
+	int ret = parse_ulong(val, 0, &v);
+	if (ret < 0)
+		return ret;
+	if (v < min || v > max) {
+		printk("parse: %lu out of range [%lu, %lu]\n", v, min, max);
+		return -ERANGE;
+	}
+	*opt = v;
+	return 0;
+}
+
+static int set_timeout(const char *val)
+{
+	return set_ulong(val, &opt_timeout, 1, 3600);
+}
+
+static int set_retries(const char *val)
+{
+	return set_ulong(val, &opt_retries, 0, 20);
+}
+
+static int set_bufsize(const char *val)
+{
+	return set_ulong(val, &opt_bufsize, 512, 1 << 20);
+}
+
+static int set_verbose(const char *val)
+{
+	opt_verbose = val == 0 || val[0] == '1' || val[0] == 'y';
+	return 0;
+}
+
+static int set_mode(const char *val)
+{
+	unsigned long i, n = strlen(val);
+	if (n >= sizeof(opt_mode))
+		return -EINVAL;
+	for (i = 0; i <= n; i++)
+		opt_mode[i] = val[i];
+	return 0;
+}
+
+static const struct option_handler handlers[] = {
+	{ "timeout", set_timeout, 1, 3600 },
+	{ "retries", set_retries, 0, 20 },
+	{ "bufsize", set_bufsize, 512, 1 << 20 },
+	{ "verbose", set_verbose, 0, 1 },
+	{ "mode", set_mode, 0, 0 },
+};
+
+int parse_option(char *opt)
+{
+	char *val = strchr(opt, '=');
+	unsigned int i;
+	if (val != 0)
+		*val++ = '\0';
+	for (i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+		if (strcmp(opt, handlers[i].name) == 0)
+			return handlers[i].set(val);
+	}
+	printk("parse: unknown option %s\n", opt);
+	return -EINVAL;
+}
+
+const char *option_describe(int which)
+{
+	switch (which) {
+	case 0:
+		return "timeout in seconds";
+	case 1:
+		return "number of retries";
+	case 2:
+		return "buffer size in bytes";
+	case 3:
+		return "verbose logging";
+	case 4:
+		return "operating mode";
+	case 5:
+		return "reserved";
+	case 6:
+		return "reserved for future use";
+	case 7:
+		return "debugging";
+	default:
+		return "unknown";
+	}
+}
+
+void option_dump(void)
+{
+	unsigned int i;
+	for (i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++)
+		printk("parse: %s: %s\n", handlers[i].name,
+		       option_describe(i));
+	printk("parse: timeout=%lu retries=%lu bufsize=%lu verbose=%d "
+	       "mode=%s\n", opt_timeout, opt_retries, opt_bufsize,
+	       opt_verbose, opt_mode);
+}
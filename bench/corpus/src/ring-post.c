@@ -0,0 +1,148 @@
+/* A kernel-style ring buffer of fixed-size records, with the faulting
+ * user copies and BUG() checks that give a kernel object its __ex_table
+ * and __bug_table entries.  ring-post.c fixes the wraparound in
+ * ring_read and adds a warning. */
+
+#include "../../bench.h"
+
+#define RING_SIZE 256
+#define EFAULT 14
+#define EAGAIN 11
+#define EINVAL 22
+
+struct record {
+	unsigned long seq;
+	unsigned int len;
+	char data[48];
+};
+
+struct ring {
+	unsigned int head, tail;
+	unsigned long seq;
+	unsigned long dropped;
+	struct record records[RING_SIZE];
+};
+
+extern int printk(const char *fmt, ...);
+extern void *kmalloc(unsigned long size, unsigned int flags);
+extern void kfree(const void *p);
+extern unsigned long copy_to_user(void *to, const void *from, unsigned long n);
+extern unsigned long copy_from_user(void *to, const void *from,
+				    unsigned long n);
+extern void spin_lock(void *lock);
+extern void spin_unlock(void *lock);
+
+static struct ring *rings[4];
+static int ring_lock;
+int ring_debug;
+const char ring_version[] = "ring 1.0";
+
+static unsigned int ring_used(const struct ring *r)
+{
+	return (r->head - r->tail) % RING_SIZE;
+}
+
+static int ring_full(const struct ring *r)
+{
+	return ring_used(r) == RING_SIZE - 1;
+}
+
+static int check_user(void)
+{
+#ifdef BENCH_HAVE_TABLES
+	BENCH_EXTABLE();
+#endif
+	return 0;
+}
+
+struct ring *ring_alloc(int id)
+{
+	struct ring *r;
+	if (id < 0 || id >= 4)
+		return 0;
+	r = kmalloc(sizeof(*r), 0xd0);
+	if (r == 0) {
+		printk("ring: out of memory for ring %d\n", id);
+		return 0;
+	}
+	r->head = r->tail = 0;
+	r->seq = 0;
+	r->dropped = 0;
+	spin_lock(&ring_lock);
+	rings[id] = r;
+	spin_unlock(&ring_lock);
+	return r;
+}
+
+void ring_free(int id)
+{
+	spin_lock(&ring_lock);
+#ifdef BENCH_HAVE_TABLES
+	if (rings[id] == 0)
+		BENCH_BUG();
+#endif
+	kfree(rings[id]);
+	rings[id] = 0;
+	spin_unlock(&ring_lock);
+}
+
+int ring_write(int id, const void *buf, unsigned int len)
+{
+	struct ring *r = rings[id];
+	struct record *rec;
+	if (len > sizeof(rec->data))
+		return -EINVAL;
+	if (ring_full(r)) {
+		r->dropped++;
+		if (ring_debug)
+			printk("ring %d: dropped record %lu\n", id, r->seq);
+		return -EAGAIN;
+	}
+	rec = &r->records[r->head];
+	if (check_user() || copy_from_user(rec->data, buf, len))
+		return -EFAULT;
+	rec->seq = r->seq++;
+	rec->len = len;
+	r->head = (r->head + 1) % RING_SIZE;
+	return len;
+}
+
+int ring_read(int id, void *buf, unsigned int len)
+{
+	struct ring *r = rings[id];
+	struct record *rec;
+	if (ring_used(r) == 0)
+		return -EAGAIN;
+	rec = &r->records[r->tail];
+	if (len < rec->len)
+		printk("ring %d: record %lu truncated to %u bytes\n", id,
+		       rec->seq, len);
+	if (len > rec->len)
+		len = rec->len;
+	if (check_user() || copy_to_user(buf, rec->data, len))
+		return -EFAULT;
+	r->tail = (r->tail + 1) % RING_SIZE;
+	return len;
+}
+
+unsigned long ring_stats(int id, unsigned long *dropped)
+{
+	struct ring *r = rings[id];
+#ifdef BENCH_HAVE_TABLES
+	if (r == 0)
+		BENCH_BUG();
+#endif
+	*dropped = r->dropped;
+	return r->seq;
+}
+
+void ring_dump(int id)
+{
+	struct ring *r = rings[id];
+	unsigned int i;
+	printk("%s: ring %d head %u tail %u\n", ring_version, id, r->head,
+	       r->tail);
+	for (i = r->tail; i != r->head; i = (i + 1) % RING_SIZE)
+		printk("  %lu: %u bytes\n", r->records[i].seq,
+		       r->records[i].len);
+}
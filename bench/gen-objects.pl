@@ -0,0 +1,130 @@
+#!/usr/bin/perl
+
+# Copyright (C) 2008-2009  Ksplice, Inc.
+# Authors: Anders Kaseorg, Jeff Arnold, Tim Abbott
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street - Fifth Floor, Boston, MA
+# 02110-1301, USA.
+
+# Writes <dir>/<name>-pre.c and <dir>/<name>-post.c, a synthetic pair of
+# translation units for benchmarking ksplice-objmanip, and <dir>/<name>.map,
+# System.map lines for the external symbols they use.  The output depends
+# only on the options, so the same options always give the same objects.
+
+use strict;
+use warnings;
+use Getopt::Long;
+
+my %opt = (
+	seed => 1,
+	functions => 1000,
+	relocs => 4000,
+	strings => 500,
+	"ex-table" => 100,
+	"bug-table" => 100,
+	"change-rate" => 0.01,
+);
+GetOptions(\%opt, "seed=i", "functions=i", "relocs=i", "strings=i",
+	   "ex-table=i", "bug-table=i", "change-rate=f")
+    && @ARGV == 2
+    or die "Usage: $0 [--seed=N] [--functions=N] [--relocs=N] [--strings=N] [--ex-table=N] [--bug-table=N] [--change-rate=F] <dir> <name>\n";
+my ($dir, $name) = @ARGV;
+
+# A small deterministic generator, so that the output does not depend on
+# the perl version's rand()
+my $state = $opt{seed};
+sub rnd {
+	my ($n) = @_;
+	$state = ($state * 1103515245 + 12345) % 2**31;
+	return int($state / 2**31 * $n);
+}
+
+my $nfuncs = $opt{functions};
+my $nexterns = int($nfuncs / 8) + 1;
+my $ndata = int($nfuncs / 4) + 1;
+
+# Each function gets a list of references; each is a call to another
+# function or an external, a use of a string, or a use of a data object.
+my @refs = map { [] } (0 .. $nfuncs - 1);
+foreach my $i (0 .. $opt{relocs} - 1) {
+	my $f = rnd($nfuncs);
+	my $kind = rnd(4);
+	if ($kind == 0) {
+		push @{$refs[$f]}, ["call", "func_" . rnd($nfuncs)];
+	} elsif ($kind == 1) {
+		push @{$refs[$f]}, ["call", "ext_" . rnd($nexterns)];
+	} elsif ($kind == 2 && $opt{strings} > 0) {
+		push @{$refs[$f]}, ["string", rnd($opt{strings})];
+	} else {
+		push @{$refs[$f]}, ["data", "data_" . rnd($ndata)];
+	}
+}
+push @{$refs[rnd($nfuncs)]}, ["extable"] foreach (1 .. $opt{"ex-table"});
+push @{$refs[rnd($nfuncs)]}, ["bug"] foreach (1 .. $opt{"bug-table"});
+
+my %changed;
+foreach my $f (0 .. $nfuncs - 1) {
+	$changed{$f} = 1 if (rnd(1_000_000) < $opt{"change-rate"} * 1_000_000);
+}
+
+# Every tenth function is static, to exercise the local symbol labels
+sub linkage {
+	my ($f) = @_;
+	return $f % 10 == 9 ? "static " : "";
+}
+
+sub write_source {
+	my ($file, $post) = @_;
+	open(my $fh, '>', $file) or die "$file: $!";
+	print $fh "/* Generated by gen-objects.pl; do not edit */\n";
+	print $fh "#include \"bench.h\"\n\n";
+	print $fh "extern int bench_log(const char *fmt, int x);\n";
+	print $fh "extern int ext_$_(int x);\n" foreach (0 .. $nexterns - 1);
+	print $fh "int data_${_}[16];\n" foreach (0 .. $ndata - 1);
+	print $fh "\n";
+	print $fh linkage($_), "int func_$_(int x);\n" foreach (0 .. $nfuncs - 1);
+	foreach my $f (0 .. $nfuncs - 1) {
+		my $mult = 2 * $f + 3 + ($post && $changed{$f} ? 2 : 0);
+		print $fh "\n", linkage($f), "int func_$f(int x)\n{\n";
+		print $fh "\tx = x * $mult + $f;\n";
+		foreach my $ref (@{$refs[$f]}) {
+			my ($kind, $target) = @$ref;
+			if ($kind eq "call") {
+				print $fh "\tx += $target(x);\n";
+			} elsif ($kind eq "string") {
+				my $text = "string $target";
+				$text .= " (patched)" if ($post && $changed{$f});
+				print $fh "\tx += bench_log(\"$text: %d\\n\", x);\n";
+			} elsif ($kind eq "data") {
+				print $fh "\tx += $target\[x & 15\];\n";
+			} elsif ($kind eq "extable") {
+				print $fh "#ifdef BENCH_HAVE_TABLES\n\tBENCH_EXTABLE();\n#endif\n";
+			} elsif ($kind eq "bug") {
+				print $fh "#ifdef BENCH_HAVE_TABLES\n\tif (x == $f)\n\t\tBENCH_BUG();\n#endif\n";
+			}
+		}
+		print $fh "\treturn x;\n}\n";
+	}
+	close($fh) or die "$file: $!";
+}
+
+write_source("$dir/$name-pre.c", 0);
+write_source("$dir/$name-post.c", 1);
+
+open(my $map, '>', "$dir/$name.map") or die "$dir/$name.map: $!";
+my $addr = 0x81000000;
+foreach my $sym ("bench_log", map { "ext_$_" } (0 .. $nexterns - 1)) {
+	printf $map "ffffffff%08x T %s\n", $addr, $sym;
+	$addr += 0x40;
+}
+close($map) or die "$dir/$name.map: $!";
@@ -0,0 +1,61 @@
+/*  Copyright (C) 2008-2009  Ksplice, Inc.
+ *  Authors: Anders Kaseorg, Tim Abbott, Jeff Arnold
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License, version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street - Fifth Floor, Boston, MA
+ *  02110-1301, USA.
+ */
+
+/* A kmodsrc/offsets.c that can be built without a kernel tree, describing
+ * the tables in the generated benchmark objects.  ksplice-objmanip reads
+ * it through KSPLICE_KMODSRC.
+ */
+
+#include <stddef.h>
+#include "bench.h"
+#include "../kmodsrc/offsets.h"
+
+const struct ksplice_config config
+    __attribute__((section(".ksplice_config"))) = {
+	.ignore_devinit = 1,
+	.ignore_cpuinit = 1,
+	.ignore_meminit = 1,
+};
+
+#define FIELD_SIZEOF(t, f) (sizeof(((t *)0)->f))
+#define FIELD_ENDOF(t, f) (offsetof(t, f) + FIELD_SIZEOF(t, f))
+
+const struct table_section table_sections[]
+    __attribute__((section(".ksplice_table_sections"))) = {
+	{
+		.sect = "__bug_table",
+		.entry_size = sizeof(struct bug_entry),
+		.entry_contents_size = FIELD_ENDOF(struct bug_entry, flags),
+		.entry_align = __alignof__(struct bug_entry),
+		.has_addr = 1,
+		.addr_offset = offsetof(struct bug_entry, bug_addr),
+	},
+	{
+		.sect = "__ex_table",
+		.entry_size = sizeof(struct exception_table_entry),
+		.entry_align = __alignof__(struct exception_table_entry),
+		.has_addr = 1,
+		.addr_offset = offsetof(struct exception_table_entry, insn),
+		.other_sect = ".fixup",
+		.other_offset = offsetof(struct exception_table_entry, fixup),
+	},
+};
+
+const char *__attribute__((section(".uts_sysname"))) sysname = "Linux";
+const char *__attribute__((section(".uts_release"))) release = "bench";
+const char *__attribute__((section(".uts_version"))) version = "#1";
+const char *__attribute__((section(".uts_machine"))) machine = "bench";
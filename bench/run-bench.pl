@@ -0,0 +1,210 @@
+#!/usr/bin/perl
+
+# Copyright (C) 2008-2009  Ksplice, Inc.
+# Authors: Anders Kaseorg, Jeff Arnold, Tim Abbott
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street - Fifth Floor, Boston, MA
+# 02110-1301, USA.
+
+# Times ksplice-objmanip on each <name>-pre.o/<name>-post.o pair found in
+# the corpus directories.  Each pair is run through keep-new-code and
+# keep-old-code, and their outputs through finalize and rmsyms, the best
+# of --repeat runs is reported, and the times are compared against the
+# baseline file.  Exits with status 1 if any time regressed by more than
+# --tolerance.
+#
+# Normally all operations of a run go to one "objmanip --batch" process
+# and the times come from its KSPLICE_PROFILE records.  Objmanips from
+# before --batch or KSPLICE_PROFILE are run once per operation instead,
+# as is any objmanip with --no-batch or whose batch fails, and then each
+# time is the whole process's wall time as measured here, including
+# loading System.map.  An operation that fails there is reported as
+# FAILED and the others still run, so that an old objmanip that dies on
+# one pair can still be compared on the rest.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use File::Basename;
+use File::Path;
+use Time::HiRes qw(time);
+
+my $objmanip = "../objmanip";
+my $kmodsrc = ".";
+my $config_dir = ".";
+my $work = "work";
+my $baseline = "baseline";
+my $repeat = 3;
+my $tolerance = 0.10;
+my $save = 0;
+my $batch;
+GetOptions("objmanip=s" => \$objmanip,
+	   "kmodsrc=s" => \$kmodsrc,
+	   "config=s" => \$config_dir,
+	   "work=s" => \$work,
+	   "baseline=s" => \$baseline,
+	   "repeat=i" => \$repeat,
+	   "tolerance=f" => \$tolerance,
+	   "save" => \$save,
+	   "batch!" => \$batch)
+    && @ARGV > 0
+    or die "Usage: $0 [--objmanip=PATH] [--kmodsrc=DIR] [--config=DIR] [--work=DIR] [--baseline=FILE] [--repeat=N] [--tolerance=F] [--save] [--[no-]batch] <corpus dir>...\n";
+
+# Differences smaller than this are timer noise, not regressions
+my $noise = 0.005;
+
+my @pairs;
+foreach my $dir (@ARGV) {
+	foreach my $pre (sort glob("$dir/*-pre.o")) {
+		(my $post = $pre) =~ s/-pre\.o$/-post.o/;
+		next unless (-e $post);
+		my $name = basename($pre, "-pre.o");
+		push @pairs, [$name, $pre, $post];
+	}
+}
+die "No <name>-pre.o/<name>-post.o pairs found in @ARGV\n" unless (@pairs);
+
+mkpath($work);
+$ENV{KSPLICE_KMODSRC} = $kmodsrc;
+$ENV{KSPLICE_CONFIG_DIR} = $config_dir;
+$ENV{KSPLICE_PROFILE} = "$work/profile";
+delete $ENV{KSPLICE_VERBOSE};
+delete $ENV{KSPLICE_SYSTEM_MAP_INDEX};
+
+# An objmanip without --batch takes it for an input file and fails
+$batch = system("$objmanip --batch </dev/null >/dev/null 2>&1") == 0
+    if (!defined $batch);
+
+# [input, mode, wall seconds or undef if it failed] for each operation
+# of the current run
+my @walls;
+
+# Returns false if a batch failed
+sub run_ops {
+	my (@ops) = @_;
+	return 1 unless (@ops);
+	if ($batch) {
+		open(my $fh, '|-', $objmanip, "--batch") or die "$objmanip: $!";
+		print $fh join(" ", @$_), "\n" foreach (@ops);
+		return close($fh);
+	}
+	foreach my $op (@ops) {
+		my $start = time;
+		my $ok = system($objmanip, @$op) == 0;
+		print STDERR "$objmanip @$op failed\n" if (!$ok);
+		push @walls, [$op->[0], $op->[2], $ok ? time - $start : undef];
+	}
+	return 1;
+}
+
+# The best wall time of each "<name> <mode>" over all repeats, and
+# those that failed in any of them
+my (%best, %failed);
+foreach my $run (1 .. $repeat) {
+	unlink("$work/profile");
+	@walls = ();
+	my %input_name;
+	my (@code_ops, @final_ops);
+	foreach my $pair (@pairs) {
+		my ($name, $pre, $post) = @$pair;
+		my ($new, $old) = ("$work/$name.new", "$work/$name.old");
+		unlink($new, $old, "$work/$name.final", "$work/$name.rmsyms");
+		$input_name{$post} = $input_name{$pre} = $name;
+		$input_name{$new} = $input_name{$old} = $name;
+		push @code_ops, [$post, $new, "keep-new-code", $pre, "bench"];
+		push @code_ops, [$pre, $old, "keep-old-code"];
+	}
+	my $batch_ok = run_ops(@code_ops);
+	foreach my $pair (@pairs) {
+		my ($name) = @$pair;
+		my ($new, $old) = ("$work/$name.new", "$work/$name.old");
+		# keep-new-code writes nothing if nothing changed
+		push @final_ops, [$new, "$work/$name.final", "finalize", "vmlinux"]
+		    if (-e $new);
+		push @final_ops, [$old, "$work/$name.rmsyms", "rmsyms"] if (-e $old);
+	}
+	$batch_ok = run_ops(@final_ops) if ($batch_ok);
+	if ($batch && !($batch_ok && -e "$work/profile")) {
+		print STDERR "$objmanip ",
+		    $batch_ok ? "wrote no profile" : "--batch failed",
+		    "; running one process per operation\n";
+		$batch = 0;
+		redo;
+	}
+
+	if ($batch) {
+		open(my $profile, '<', "$work/profile")
+		    or die "$work/profile: $!";
+		while (<$profile>) {
+			my ($input, $mode, $wall) =
+			    /"input":"([^"]*)","mode":"([^"]*)","wall":([\d.]+)/
+			    or next;
+			push @walls, [$input, $mode, $wall];
+		}
+		close($profile);
+	}
+	foreach (@walls) {
+		my ($input, $mode, $wall) = @$_;
+		my $key = "$input_name{$input} $mode";
+		if (!defined $wall) {
+			$failed{$key} = 1;
+		} elsif (!defined $best{$key} || $wall < $best{$key}) {
+			$best{$key} = $wall;
+		}
+	}
+}
+delete @best{keys(%failed)};
+
+my %base;
+if (-e $baseline) {
+	open(my $fh, '<', $baseline) or die "$baseline: $!";
+	while (<$fh>) {
+		next if (/^#/ || /^\s*$/);
+		my ($name, $mode, $wall) = split;
+		$base{"$name $mode"} = $wall;
+	}
+	close($fh);
+}
+
+my $regressions = 0;
+foreach my $key (sort(keys(%best), keys(%failed))) {
+	my ($name, $mode) = split(/ /, $key);
+	if ($failed{$key}) {
+		printf("%-24s %-14s    FAILED\n", $name, $mode);
+		next;
+	}
+	printf("%-24s %-14s %8.3fs", $name, $mode, $best{$key});
+	if (defined $base{$key}) {
+		my $delta = $best{$key} - $base{$key};
+		my $ratio = $base{$key} > 0 ? $delta / $base{$key} : 0;
+		printf("  baseline %8.3fs  %+6.1f%%", $base{$key}, 100 * $ratio);
+		if ($ratio > $tolerance && $delta > $noise) {
+			print "  REGRESSION";
+			$regressions++;
+		}
+	}
+	print "\n";
+}
+
+if ($save) {
+	open(my $fh, '>', $baseline) or die "$baseline: $!";
+	print $fh "# <name> <mode> <best wall seconds>, written by run-bench.pl --save\n";
+	print $fh "$_ $best{$_}\n" foreach (sort keys(%best));
+	close($fh) or die "$baseline: $!";
+	print "Baseline written to $baseline\n";
+} elsif ($regressions || %failed) {
+	print "$regressions regressions beyond ", 100 * $tolerance, "%\n"
+	    if ($regressions);
+	print scalar(keys(%failed)), " operations failed\n" if (%failed);
+	exit(1);
+}
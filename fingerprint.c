@@ -0,0 +1,177 @@
+/*  Copyright (C) 2008-2009  Ksplice, Inc.
+ *  Authors: Tim Abbott, Anders Kaseorg, Jeff Arnold
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License, version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street - Fifth Floor, Boston, MA
+ *  02110-1301, USA.
+ */
+
+/* fingerprint prints "<hash> <file>" for each object file argument.  Two
+ * objects with the same hash have the same sections, contents,
+ * relocations and symbols, ignoring .comment and debugging sections and
+ * the order of the symbol and string tables, so ksplice-obj.pl can skip
+ * diffing them even when their bytes differ.  Other files, such as
+ * archives, are hashed byte for byte.
+ */
+
+#define _GNU_SOURCE
+#include "objcommon.h"
+#include <stdint.h>
+#include <stdio.h>
+
+DECLARE_VEC_TYPE(uint64_t, u64_vec);
+
+#define FNV_INIT 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size)
+{
+	const unsigned char *p;
+	for (p = data; p < (const unsigned char *)data + size; p++)
+		h = (h ^ *p) * FNV_PRIME;
+	return h;
+}
+
+static uint64_t hash_u64(uint64_t h, uint64_t x)
+{
+	return hash_bytes(h, &x, sizeof(x));
+}
+
+static uint64_t hash_str(uint64_t h, const char *str)
+{
+	return hash_bytes(h, str, strlen(str) + 1);
+}
+
+static int compare_u64(const void *va, const void *vb)
+{
+	const uint64_t *a = va, *b = vb;
+	if (*a != *b)
+		return *a < *b ? -1 : 1;
+	return 0;
+}
+
+/* Combine hashes without regard to their order */
+static uint64_t hash_unordered(uint64_t h, struct u64_vec *hashes)
+{
+	qsort(hashes->data, hashes->size, sizeof(*hashes->data), compare_u64);
+	uint64_t *hp;
+	for (hp = hashes->data; hp < hashes->data + hashes->size; hp++)
+		h = hash_u64(h, *hp);
+	return h;
+}
+
+static bool ignored_section(asection *sect)
+{
+	return strcmp(sect->name, ".comment") == 0 ||
+	    strstarts(sect->name, ".debug");
+}
+
+static uint64_t hash_symbol(uint64_t h, asymbol *sym)
+{
+	h = hash_str(h, sym->name);
+	h = hash_str(h, sym->section->name);
+	h = hash_u64(h, sym->flags);
+	return hash_u64(h, sym->value);
+}
+
+static uint64_t hash_section(struct superbfd *sbfd, asection *sect)
+{
+	struct supersect *ss = fetch_supersect(sbfd, sect);
+	uint64_t h = FNV_INIT;
+	h = hash_str(h, ss->name);
+	h = hash_u64(h, ss->flags);
+	h = hash_u64(h, ss->alignment);
+	h = hash_u64(h, ss->entsize);
+	h = hash_u64(h, ss->contents.size);
+	if ((ss->flags & SEC_HAS_CONTENTS) != 0)
+		h = hash_bytes(h, ss->contents.data, ss->contents.size);
+
+	arelent **relocp;
+	for (relocp = ss->relocs.data;
+	     relocp < ss->relocs.data + ss->relocs.size; relocp++) {
+		arelent *reloc = *relocp;
+		h = hash_u64(h, reloc->address);
+		h = hash_u64(h, reloc->addend);
+		h = hash_u64(h, reloc->howto->type);
+		h = hash_symbol(h, *reloc->sym_ptr_ptr);
+	}
+	return h;
+}
+
+static uint64_t fingerprint(struct superbfd *sbfd)
+{
+	struct u64_vec hashes;
+	vec_init(&hashes);
+	uint64_t h = hash_str(FNV_INIT, bfd_get_target(sbfd->abfd));
+
+	asection *sect;
+	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
+		if (ignored_section(sect))
+			continue;
+		*vec_grow(&hashes, 1) = hash_section(sbfd, sect);
+	}
+	h = hash_unordered(h, &hashes);
+
+	hashes.size = 0;
+	asymbol **symp;
+	for (symp = sbfd->syms.data; symp < sbfd->syms.data + sbfd->syms.size;
+	     symp++) {
+		asymbol *sym = *symp;
+		if (!bfd_is_const_section(sym->section) &&
+		    ignored_section(sym->section))
+			continue;
+		*vec_grow(&hashes, 1) = hash_symbol(FNV_INIT, sym);
+	}
+	h = hash_unordered(h, &hashes);
+
+	vec_free(&hashes);
+	return h;
+}
+
+static uint64_t fingerprint_file(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	assert(fp != NULL);
+	uint64_t h = FNV_INIT;
+	char buf[BUFSIZ];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		h = hash_bytes(h, buf, n);
+	assert(!ferror(fp));
+	fclose(fp);
+	return h;
+}
+
+int main(int argc, char *argv[])
+{
+	bfd_init();
+	int i, ret = 0;
+	for (i = 1; i < argc; i++) {
+		bfd *ibfd = bfd_openr(argv[i], NULL);
+		if (ibfd == NULL) {
+			fprintf(stderr, "ksplice-fingerprint: %s: %s\n", argv[i],
+				bfd_errmsg(bfd_get_error()));
+			ret = 1;
+			continue;
+		}
+
+		uint64_t h;
+		char **matching;
+		if (bfd_check_format_matches(ibfd, bfd_object, &matching))
+			h = fingerprint(fetch_superbfd(ibfd));
+		else
+			h = fingerprint_file(argv[i]);
+		printf("%016llx %s\n", (unsigned long long)h, argv[i]);
+		assert(bfd_close(ibfd));
+	}
+	return ret;
+}
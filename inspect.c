@@ -22,20 +22,29 @@
 #define _GNU_SOURCE
 #include "objcommon.h"
 #include "kmodsrc/ksplice.h"
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 char *str_pointer(struct supersect *ss, void *const *addr);
 
-struct kreloc_section {
-	struct supersect *ss;
-	const struct ksplice_reloc *reloc;
+/* A Ksplice relocation, read either from a struct ksplice_reloc or from
+   a .ksplice_reloc_table */
+struct kreloc {
+	const char *blank_addr;
+	const char *symbol;
+	struct supersect *howto_ss;
+	const struct ksplice_reloc_howto *howto;
+	long insn_addend;
+	long target_addend;
 };
 
-#define kreloc_section_init(ks) *(ks) = NULL
-DEFINE_HASH_TYPE(struct kreloc_section *, kreloc_section_hash,
-		 kreloc_section_hash_init, kreloc_section_hash_free,
-		 kreloc_section_hash_lookup, kreloc_section_init);
-struct kreloc_section_hash ksplice_relocs;
+#define kreloc_init(kr) (kr)->blank_addr = NULL
+DEFINE_ADDR_HASH_TYPE(struct kreloc, kreloc_hash, kreloc_hash_init,
+		      kreloc_hash_free, kreloc_hash_lookup, kreloc_init);
+struct kreloc_hash ksplice_relocs;
 
 char *str_ulong_vec(struct supersect *ss, const unsigned long *const *datap,
 		    const unsigned long *sizep)
@@ -57,18 +66,9 @@ char *str_ulong_vec(struct supersect *ss, const unsigned long *const *datap,
 	return buf;
 }
 
-static const struct ksplice_reloc *
-find_ksplice_reloc(struct supersect *ss, void *const *addr,
-		   struct supersect **reloc_ss)
+static const struct kreloc *find_ksplice_reloc(const void *addr)
 {
-	char *key = strprintf("%p", addr);
-	struct kreloc_section **ksp =
-	    kreloc_section_hash_lookup(&ksplice_relocs, key, FALSE);
-	free(key);
-	if (ksp == NULL)
-		return NULL;
-	*reloc_ss = (*ksp)->ss;
-	return (*ksp)->reloc;
+	return kreloc_hash_lookup(&ksplice_relocs, addr, 0, FALSE);
 }
 
 char *str_ksplice_symbol(struct supersect *ss,
@@ -96,16 +96,12 @@ char *str_ksplice_symbolp(struct supersect *ptr_ss,
 char *str_pointer(struct supersect *ss, void *const *addr)
 {
 	asymbol *sym;
-	struct supersect *kreloc_ss;
-	const struct ksplice_reloc *kreloc =
-	    find_ksplice_reloc(ss, addr, &kreloc_ss);
+	const struct kreloc *kreloc = find_ksplice_reloc(addr);
 	if (kreloc == NULL) {
 		bfd_vma offset = read_reloc(ss, addr, sizeof(*addr), &sym);
 		return strprintf("%s+%lx", sym->name, (unsigned long)offset);
 	} else {
-		return strprintf("[%s]+%lx",
-				 str_ksplice_symbolp(kreloc_ss,
-						     &kreloc->symbol),
+		return strprintf("[%s]+%lx", kreloc->symbol,
 				 kreloc->target_addend);
 	}
 }
@@ -132,12 +128,10 @@ static const char *str_howto_type(const struct ksplice_reloc_howto *howto)
 	}
 }
 
-void show_ksplice_reloc(struct supersect *ss,
-			const struct ksplice_reloc *kreloc)
+static void show_ksplice_reloc(const void *blank, const struct kreloc *kreloc)
 {
-	struct supersect *khowto_ss;
-	const struct ksplice_reloc_howto *khowto =
-	    read_pointer(ss, (void *const *)&kreloc->howto, &khowto_ss);
+	struct supersect *khowto_ss = kreloc->howto_ss;
+	const struct ksplice_reloc_howto *khowto = kreloc->howto;
 	printf("  blank_addr: %s  size: %x\n"
 	       "  type: %s\n"
 	       "  symbol: %s\n"
@@ -145,24 +139,147 @@ void show_ksplice_reloc(struct supersect *ss,
 	       "  target_addend: %lx\n"
 	       "  pcrel: %x  dst_mask: %lx  rightshift: %x  signed_addend: %x\n"
 	       "\n",
-	       str_pointer(ss, (void *const *)&kreloc->blank_addr),
+	       kreloc->blank_addr,
 	       read_num(khowto_ss, &khowto->size),
 	       str_howto_type(khowto),
-	       str_ksplice_symbolp(ss, &kreloc->symbol),
-	       read_num(ss, &kreloc->insn_addend),
-	       read_num(ss, &kreloc->target_addend),
+	       kreloc->symbol,
+	       kreloc->insn_addend,
+	       kreloc->target_addend,
 	       read_num(khowto_ss, &khowto->pcrel),
 	       read_num(khowto_ss, &khowto->dst_mask),
 	       read_num(khowto_ss, &khowto->rightshift),
 	       read_num(khowto_ss, &khowto->signed_addend));
 }
 
-void show_ksplice_relocs(struct supersect *kreloc_ss)
+static void read_ksplice_relocs(struct supersect *kreloc_ss,
+				void (*fn)(const void *blank,
+					   const struct kreloc *kreloc))
 {
 	const struct ksplice_reloc *kreloc;
 	for (kreloc = kreloc_ss->contents.data; (void *)kreloc <
-	     kreloc_ss->contents.data + kreloc_ss->contents.size; kreloc++)
-		show_ksplice_reloc(kreloc_ss, kreloc);
+	     kreloc_ss->contents.data + kreloc_ss->contents.size; kreloc++) {
+		struct kreloc kr;
+		asymbol *sym;
+		bfd_vma offset = read_reloc(kreloc_ss, &kreloc->blank_addr,
+					    sizeof(kreloc->blank_addr), &sym);
+		const void *blank =
+		    read_pointer(kreloc_ss, (void *const *)&kreloc->blank_addr,
+				 NULL);
+		kr.blank_addr = strprintf("%s+%lx", sym->name,
+					  (unsigned long)offset);
+		kr.symbol = str_ksplice_symbolp(kreloc_ss, &kreloc->symbol);
+		kr.howto = read_pointer(kreloc_ss,
+					(void *const *)&kreloc->howto,
+					&kr.howto_ss);
+		kr.insn_addend = read_num(kreloc_ss, &kreloc->insn_addend);
+		kr.target_addend = read_num(kreloc_ss, &kreloc->target_addend);
+		fn(blank, &kr);
+	}
+}
+
+static const unsigned char *read_uleb128(const unsigned char *p,
+					 const unsigned char *end,
+					 unsigned long *val)
+{
+	int shift = 0;
+	*val = 0;
+	do {
+		assert(p < end && shift < 8 * sizeof(*val));
+		*val |= (unsigned long)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
+static const unsigned char *read_sleb128(const unsigned char *p,
+					 const unsigned char *end, long *val)
+{
+	unsigned long uval = 0;
+	unsigned char byte;
+	int shift = 0;
+	do {
+		assert(p < end && shift < 8 * sizeof(uval));
+		byte = *p++;
+		uval |= (unsigned long)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < 8 * sizeof(uval) && (byte & 0x40) != 0)
+		uval |= ~0UL << shift;
+	*val = uval;
+	return p;
+}
+
+static void read_ksplice_reloc_table(struct supersect *table_ss,
+				     void (*fn)(const void *blank,
+						const struct kreloc *kreloc))
+{
+	struct superbfd *sbfd = table_ss->parent;
+	const struct ksplice_reloc_table *table = table_ss->contents.data;
+	const unsigned char *end = table_ss->contents.data +
+	    table_ss->contents.size;
+	assert(table->version == KSPLICE_RELOC_TABLE_VERSION);
+	const struct ksplice_reloc_run *run =
+	    (const struct ksplice_reloc_run *)(table->howtos +
+					       table->nr_howtos);
+	const struct ksplice_reloc_run *runs_end = run + table->nr_runs;
+	const unsigned char *p = (const unsigned char *)runs_end;
+	assert(p <= end);
+
+	asection *ksymbol_sect = bfd_get_section_by_name(sbfd->abfd,
+							 ".ksplice_symbols");
+	assert(ksymbol_sect != NULL);
+	struct supersect *ksymbol_ss = fetch_supersect(sbfd, ksymbol_sect);
+	const struct ksplice_symbol *ksymbols = ksymbol_ss->contents.data;
+	unsigned long nr_ksymbols =
+	    ksymbol_ss->contents.size / sizeof(*ksymbols);
+
+	for (; run < runs_end; run++) {
+		asymbol *sym;
+		bfd_vma offset = read_reloc(table_ss, &run->base,
+					    sizeof(run->base), &sym);
+		assert(!bfd_is_const_section(sym->section));
+		struct supersect *sym_ss = fetch_supersect(sbfd, sym->section);
+		offset += sym->value;
+
+		const unsigned char *run_end = p + run->size;
+		assert(run_end <= end);
+		unsigned int i;
+		for (i = 0; i < run->nr_relocs; i++) {
+			struct kreloc kr;
+			unsigned long delta, howto, symbol;
+			p = read_uleb128(p, run_end, &delta);
+			p = read_uleb128(p, run_end, &howto);
+			p = read_uleb128(p, run_end, &symbol);
+			p = read_sleb128(p, run_end, &kr.insn_addend);
+			p = read_sleb128(p, run_end, &kr.target_addend);
+			assert(howto < table->nr_howtos);
+			assert(symbol < nr_ksymbols);
+
+			offset += delta;
+			kr.blank_addr = strprintf("%s+%lx", sym->name,
+						  (unsigned long)offset);
+			kr.symbol = str_ksplice_symbol(ksymbol_ss,
+						       &ksymbols[symbol]);
+			kr.howto_ss = table_ss;
+			kr.howto = &table->howtos[howto];
+			fn(sym_ss->contents.data + offset, &kr);
+		}
+		assert(p == run_end);
+	}
+}
+
+void show_ksplice_relocs(struct supersect *kreloc_ss)
+{
+	read_ksplice_relocs(kreloc_ss, show_ksplice_reloc);
+}
+
+void show_ksplice_reloc_table(struct supersect *table_ss)
+{
+	const struct ksplice_reloc_table *table = table_ss->contents.data;
+	printf("  version: %u  flags: %x\n\n",
+	       read_num(table_ss, &table->version),
+	       read_num(table_ss, &table->flags));
+	read_ksplice_reloc_table(table_ss, show_ksplice_reloc);
 }
 
 void show_ksplice_section_flags(const struct ksplice_section *ksect)
@@ -266,11 +383,150 @@ void show_ksplice_system_maps(struct supersect *smap_ss)
 		show_ksplice_system_map(smap_ss, smap);
 }
 
+static void show_ksplice_symbol_chains(struct supersect *ksymbol_ss,
+				      const unsigned int *buckets,
+				      const unsigned int *next,
+				      unsigned int nr_buckets, bool by_name)
+{
+	const struct ksplice_symbol *ksymbols = ksymbol_ss->contents.data;
+	unsigned int bucket, i;
+	for (bucket = 0; bucket < nr_buckets; bucket++) {
+		if (buckets[bucket] == KSPLICE_SYMBOL_HASH_END)
+			continue;
+		printf("  %x:", bucket);
+		for (i = buckets[bucket]; i != KSPLICE_SYMBOL_HASH_END;
+		     i = next[i]) {
+			const char *str = read_string(ksymbol_ss, by_name ?
+						      &ksymbols[i].name :
+						      &ksymbols[i].label);
+			assert((ksplice_string_hash(str) & (nr_buckets - 1)) ==
+			       bucket);
+			printf(" %s", str);
+		}
+		printf("\n");
+	}
+}
+
+void show_ksplice_symbol_hash(struct supersect *hash_ss)
+{
+	const struct ksplice_symbol_hash *hash = hash_ss->contents.data;
+	unsigned int nr_buckets = read_num(hash_ss, &hash->nr_buckets);
+	unsigned int nr_symbols = read_num(hash_ss, &hash->nr_symbols);
+	printf("  buckets: %x  symbols: %x\n", nr_buckets, nr_symbols);
+	if (nr_symbols == 0)
+		return;
+
+	asection *ksymbol_sect = bfd_get_section_by_name(hash_ss->parent->abfd,
+							 ".ksplice_symbols");
+	assert(ksymbol_sect != NULL);
+	struct supersect *ksymbol_ss = fetch_supersect(hash_ss->parent,
+						       ksymbol_sect);
+	assert(ksymbol_ss->contents.size ==
+	       nr_symbols * sizeof(struct ksplice_symbol));
+	const unsigned int *chains = hash->chains;
+	printf("  labels:\n");
+	show_ksplice_symbol_chains(ksymbol_ss, chains,
+				   chains + 2 * nr_buckets, nr_buckets, false);
+	printf("  names:\n");
+	show_ksplice_symbol_chains(ksymbol_ss, chains + nr_buckets,
+				   chains + 2 * nr_buckets + nr_symbols,
+				   nr_buckets, true);
+	printf("\n");
+}
+
+/* "<file>\t<kind>", which starts each record that record_object prints */
+static const char *record_prefix;
+
+static void record_ksplice_reloc(const void *blank,
+				 const struct kreloc *kreloc)
+{
+	printf("%s\t%s\t%s\t%s\t%x\t%lx\t%lx\n", record_prefix,
+	       kreloc->blank_addr, kreloc->symbol,
+	       str_howto_type(kreloc->howto),
+	       read_num(kreloc->howto_ss, &kreloc->howto->size),
+	       kreloc->insn_addend, kreloc->target_addend);
+}
+
+void record_ksplice_relocs(struct supersect *kreloc_ss)
+{
+	read_ksplice_relocs(kreloc_ss, record_ksplice_reloc);
+}
+
+void record_ksplice_reloc_table(struct supersect *table_ss)
+{
+	read_ksplice_reloc_table(table_ss, record_ksplice_reloc);
+}
+
+void record_ksplice_sections(struct supersect *ksect_ss)
+{
+	const struct ksplice_section *ksect;
+	for (ksect = ksect_ss->contents.data; (void *)ksect <
+	     ksect_ss->contents.data + ksect_ss->contents.size; ksect++)
+		printf("%s\t%s\t%s\t%lx\t%x\n", record_prefix,
+		       str_ksplice_symbolp(ksect_ss, &ksect->symbol),
+		       str_pointer(ksect_ss, (void *const *)&ksect->address),
+		       read_num(ksect_ss, &ksect->size), ksect->flags);
+}
+
+void record_ksplice_patches(struct supersect *kpatch_ss)
+{
+	const struct ksplice_patch *kpatch;
+	for (kpatch = kpatch_ss->contents.data; (void *)kpatch <
+	     kpatch_ss->contents.data + kpatch_ss->contents.size; kpatch++) {
+		const char *oldaddr =
+		    str_pointer(kpatch_ss, (void *const *)&kpatch->oldaddr);
+		const char *const *strp;
+		struct supersect *data_ss;
+		switch (kpatch->type) {
+		case KSPLICE_PATCH_TEXT:
+			printf("%s\ttext\t%s\t%s\n", record_prefix, oldaddr,
+			       str_pointer(kpatch_ss,
+					   (void *const *)&kpatch->repladdr));
+			break;
+		case KSPLICE_PATCH_DATA:
+			printf("%s\tdata\t%s\t%x\n", record_prefix, oldaddr,
+			       kpatch->size);
+			break;
+		case KSPLICE_PATCH_EXPORT:
+			strp = read_pointer(kpatch_ss, &kpatch->contents,
+					    &data_ss);
+			printf("%s\texport\t%s\t%s\n", record_prefix, oldaddr,
+			       read_string(data_ss, strp));
+			break;
+		default:
+			printf("%s\tunknown\t%s\n", record_prefix, oldaddr);
+		}
+	}
+}
+
+void record_ksplice_calls(struct supersect *kcall_ss)
+{
+	void *const *kcall;
+	for (kcall = kcall_ss->contents.data; (void *)kcall <
+	     kcall_ss->contents.data + kcall_ss->contents.size; kcall++)
+		printf("%s\t%s\t%s\n", record_prefix, kcall_ss->name,
+		       str_pointer(kcall_ss, kcall));
+}
+
+void record_ksplice_system_maps(struct supersect *smap_ss)
+{
+	const struct ksplice_system_map *smap;
+	for (smap = smap_ss->contents.data;
+	     (void *)smap < smap_ss->contents.data + smap_ss->contents.size;
+	     smap++)
+		printf("%s\t%s\t%s\n", record_prefix,
+		       read_string(smap_ss, &smap->label),
+		       str_ulong_vec(smap_ss, &smap->candidates,
+				     &smap->nr_candidates));
+}
+
 struct inspect_section {
 	const char *prefix;
 	const char *header;
 	const char *notfound;
 	void (*show)(struct supersect *ss);
+	const char *kind;
+	void (*record)(struct supersect *ss);
 };
 
 const struct inspect_section inspect_sections[] = {
@@ -279,74 +535,88 @@ const struct inspect_section inspect_sections[] = {
 		.header = "KSPLICE INIT RELOCATIONS",
 		.notfound = "No ksplice init relocations.\n",
 		.show = show_ksplice_relocs,
+		.kind = "init_reloc",
+		.record = record_ksplice_relocs,
 	},
 	{
 		.prefix = ".ksplice_relocs",
 		.header = "KSPLICE RELOCATIONS",
 		.notfound = "No ksplice relocations.\n",
 		.show = show_ksplice_relocs,
+		.kind = "reloc",
+		.record = record_ksplice_relocs,
+	},
+	{
+		.prefix = ".ksplice_reloc_table",
+		.header = "KSPLICE RELOCATION TABLE",
+		.notfound = "No ksplice relocation table.\n",
+		.show = show_ksplice_reloc_table,
+		.kind = "reloc",
+		.record = record_ksplice_reloc_table,
+	},
+	{
+		.prefix = ".ksplice_symbol_hash",
+		.header = "KSPLICE SYMBOL HASH",
+		.notfound = "No ksplice symbol hash.\n",
+		.show = show_ksplice_symbol_hash,
 	},
 	{
 		.prefix = ".ksplice_sections",
 		.header = "KSPLICE SECTIONS",
 		.notfound = "No ksplice sections.\n",
 		.show = show_ksplice_sections,
+		.kind = "section",
+		.record = record_ksplice_sections,
 	},
 	{
 		.prefix = ".ksplice_patches",
 		.header = "KSPLICE PATCHES",
 		.notfound = "No ksplice patches.\n",
 		.show = show_ksplice_patches,
+		.kind = "patch",
+		.record = record_ksplice_patches,
 	},
 	{
 		.prefix = ".ksplice_call",
 		.header = "KSPLICE CALLS",
 		.notfound = "No ksplice calls.\n",
 		.show = show_ksplice_calls,
+		.kind = "call",
+		.record = record_ksplice_calls,
 	},
 	{
 		.prefix = ".ksplice_system_map",
 		.header = "KSPLICE SYSTEM.MAP",
 		.notfound = "No ksplice System.map.\n",
 		.show = show_ksplice_system_maps,
+		.kind = "system_map",
+		.record = record_ksplice_system_maps,
 	},
 }, *const inspect_sections_end = *(&inspect_sections + 1);
 
+static void load_ksplice_reloc(const void *blank, const struct kreloc *kreloc)
+{
+	if (read_num(kreloc->howto_ss, &kreloc->howto->size) == 0)
+		return;
+
+	struct kreloc *kr = kreloc_hash_lookup(&ksplice_relocs, blank, 0, TRUE);
+	assert(kr->blank_addr == NULL);
+	*kr = *kreloc;
+}
+
 static void load_ksplice_reloc_offsets(struct superbfd *sbfd)
 {
-	kreloc_section_hash_init(&ksplice_relocs);
+	kreloc_hash_init(&ksplice_relocs);
 
 	asection *sect;
 	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(sbfd, sect);
-		if (!strstarts(ss->name, ".ksplice_relocs") &&
-		    !strstarts(ss->name, ".ksplice_init_relocs"))
-			continue;
-		struct ksplice_reloc *kreloc;
-		for (kreloc = ss->contents.data;
-		     (void *)kreloc < ss->contents.data + ss->contents.size;
-		     kreloc++) {
-			const struct ksplice_reloc_howto *khowto =
-			    read_pointer(ss, (void *const *)&kreloc->howto,
-					 NULL);
-			if (khowto->size == 0)
-				continue;
-
-			struct supersect *sym_ss;
-			const void *ptr =
-			    read_pointer(ss, (void *const *)&kreloc->blank_addr,
-					 &sym_ss);
-			char *key = strprintf("%p", ptr);
-			struct kreloc_section *ks, **ksp =
-			    kreloc_section_hash_lookup(&ksplice_relocs, key,
-						       TRUE);
-			free(key);
-			assert(*ksp == NULL);
-			ks = malloc(sizeof(*ks));
-			*ksp = ks;
-			ks->reloc = kreloc;
-			ks->ss = ss;
-		}
+		if (strstarts(ss->name, ".ksplice_relocs") ||
+		    strstarts(ss->name, ".ksplice_init_relocs"))
+			read_ksplice_relocs(ss, load_ksplice_reloc);
+		else if (strcmp(ss->name, ".ksplice_reloc_table") == 0 &&
+			 ss->contents.size != 0)
+			read_ksplice_reloc_table(ss, load_ksplice_reloc);
 	}
 }
 
@@ -369,12 +639,181 @@ static void show_inspect_section(struct superbfd *sbfd,
 	printf("\n");
 }
 
+/*
+ * Print the records for one object: an "object" record and then one
+ * line per entry in its Ksplice sections, with tab-separated fields
+ * starting with the file name and the kind from inspect_sections.
+ * Returns false, after printing an "error" record, if the file cannot
+ * be read as an object.
+ */
+static bool record_object(const char *filename)
+{
+	struct arena_mark mark;
+	arena_mark(&mark);
+	bfd *ibfd = bfd_openr(filename, NULL);
+	char **matching;
+	if (ibfd == NULL ||
+	    !bfd_check_format_matches(ibfd, bfd_object, &matching)) {
+		printf("%s\terror\t%s\n", filename,
+		       bfd_errmsg(bfd_get_error()));
+		if (ibfd != NULL)
+			assert(bfd_close(ibfd));
+		arena_release(&mark);
+		return false;
+	}
+	printf("%s\tobject\t%s\n", filename, bfd_get_target(ibfd));
+
+	struct superbfd *sbfd = fetch_superbfd(ibfd);
+	load_ksplice_reloc_offsets(sbfd);
+	const struct inspect_section *isect;
+	for (isect = inspect_sections; isect < inspect_sections_end; isect++) {
+		if (isect->record == NULL)
+			continue;
+		record_prefix = strprintf("%s\t%s", filename, isect->kind);
+		asection *sect;
+		for (sect = ibfd->sections; sect != NULL; sect = sect->next) {
+			struct supersect *ss = fetch_supersect(sbfd, sect);
+			if (strstarts(ss->name, isect->prefix) &&
+			    ss->contents.size != 0)
+				isect->record(ss);
+		}
+	}
+	kreloc_hash_free(&ksplice_relocs);
+	assert(bfd_close(ibfd));
+	arena_release(&mark);
+	return true;
+}
+
+DECLARE_VEC_TYPE(char, char_vec);
+
+struct record_worker {
+	pid_t pid;
+	int fd;
+	struct char_vec buf;
+};
+
+/* Copy the complete lines (or at EOF, everything) read from a worker to
+   stdout, so that records from different workers never interleave */
+static void forward_records(struct record_worker *worker, bool eof)
+{
+	if (worker->buf.size == 0)
+		return;
+	char *end = worker->buf.data + worker->buf.size;
+	if (!eof) {
+		end = memrchr(worker->buf.data, '\n', worker->buf.size);
+		if (end == NULL)
+			return;
+		end++;
+	}
+	size_t len = end - worker->buf.data;
+	fwrite(worker->buf.data, 1, len, stdout);
+	memmove(worker->buf.data, end, worker->buf.size - len);
+	vec_resize(&worker->buf, worker->buf.size - len);
+}
+
+/*
+ * Print the records of many objects.  libbfd is not thread-safe, so
+ * rather than use parallel_for we fork ksplice_threads() workers, each
+ * taking every nworkers'th file, and stream their records to stdout as
+ * they arrive.  Records of different objects may therefore interleave,
+ * but each record carries its file name.
+ */
+static int inspect_records(int nfiles, char *files[])
+{
+	int ret = EXIT_SUCCESS;
+	int i;
+	long nworkers = ksplice_threads();
+	if (nworkers > nfiles)
+		nworkers = nfiles;
+	if (nworkers <= 1) {
+		for (i = 0; i < nfiles; i++) {
+			if (!record_object(files[i]))
+				ret = EXIT_FAILURE;
+		}
+		return ret;
+	}
+
+	struct record_worker *workers = malloc(nworkers * sizeof(*workers));
+	assert(workers != NULL);
+	long w;
+	fflush(stdout);
+	for (w = 0; w < nworkers; w++) {
+		int fds[2];
+		assert(pipe(fds) == 0);
+		pid_t pid = fork();
+		assert(pid >= 0);
+		if (pid == 0) {
+			long v;
+			for (v = 0; v < w; v++)
+				close(workers[v].fd);
+			close(fds[0]);
+			assert(dup2(fds[1], STDOUT_FILENO) >= 0);
+			close(fds[1]);
+			for (i = w; i < nfiles; i += nworkers) {
+				if (!record_object(files[i]))
+					ret = EXIT_FAILURE;
+			}
+			fflush(stdout);
+			_exit(ret);
+		}
+		close(fds[1]);
+		workers[w].pid = pid;
+		workers[w].fd = fds[0];
+		vec_init(&workers[w].buf);
+	}
+
+	struct pollfd *pfds = malloc(nworkers * sizeof(*pfds));
+	assert(pfds != NULL);
+	long nopen = nworkers;
+	while (nopen > 0) {
+		for (w = 0; w < nworkers; w++) {
+			pfds[w].fd = workers[w].fd;
+			pfds[w].events = POLLIN;
+			pfds[w].revents = 0;
+		}
+		if (poll(pfds, nworkers, -1) < 0) {
+			assert(errno == EINTR);
+			continue;
+		}
+		for (w = 0; w < nworkers; w++) {
+			struct record_worker *worker = &workers[w];
+			if (pfds[w].revents == 0)
+				continue;
+			size_t size = worker->buf.size;
+			char *buf = vec_grow(&worker->buf, 4096);
+			ssize_t n = read(worker->fd, buf, 4096);
+			assert(n >= 0 || errno == EINTR);
+			vec_resize(&worker->buf, size + (n > 0 ? n : 0));
+			forward_records(worker, n == 0);
+			if (n == 0) {
+				close(worker->fd);
+				worker->fd = -1;
+				nopen--;
+			}
+		}
+	}
+	free(pfds);
+
+	for (w = 0; w < nworkers; w++) {
+		int status;
+		assert(waitpid(workers[w].pid, &status, 0) == workers[w].pid);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+		vec_free(&workers[w].buf);
+	}
+	free(workers);
+	fflush(stdout);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	bfd *ibfd;
 
 	assert(argc >= 1);
 	bfd_init();
+	if (argc >= 2 && strcmp(argv[1], "--records") == 0)
+		return inspect_records(argc - 2, argv + 2);
 	ibfd = bfd_openr(argv[1], NULL);
 	assert(ibfd);
 
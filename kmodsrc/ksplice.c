@@ -193,8 +193,7 @@ struct candidate_val {
 struct ksplice_lookup {
 /* input */
 	struct ksplice_mod_change *change;
-	struct ksplice_symbol **arr;
-	size_t size;
+	struct ksplice_code *code;
 /* output */
 	abort_t ret;
 };
@@ -642,17 +641,22 @@ static abort_t lookup_symbol(struct ksplice_mod_change *change,
 static void cleanup_symbol_arrays(struct ksplice_mod_change *change);
 static abort_t init_symbol_arrays(struct ksplice_mod_change *change);
 static abort_t init_symbol_array(struct ksplice_mod_change *change,
-				 struct ksplice_symbol *start,
-				 struct ksplice_symbol *end);
+				 struct ksplice_code *code);
 static abort_t uniquify_symbols(struct ksplice_mod_change *change);
+static void unify_symbol(struct ksplice_code *code,
+			 struct ksplice_symbol **symp);
 static abort_t add_matching_values(struct ksplice_lookup *lookup,
 				   const char *sym_name, unsigned long sym_val);
 static bool add_export_values(const struct symsearch *syms,
 			      struct module *owner,
 			      unsigned int symnum, void *data);
-static int symbolp_bsearch_compare(const void *key, const void *elt);
-static int compare_symbolp_names(const void *a, const void *b);
-static int compare_symbolp_labels(const void *a, const void *b);
+static int check_symbol_hash(const struct ksplice_code *code);
+static unsigned int *symbol_hash_bucket(const struct ksplice_code *code,
+					const char *str, bool by_name);
+static unsigned int *symbol_hash_next(const struct ksplice_code *code,
+				      unsigned int i, bool by_name);
+static struct ksplice_symbol *label_symbol(const struct ksplice_code *code,
+					   const char *label);
 #ifdef CONFIG_KALLSYMS
 static int add_kallsyms_values(void *data, const char *name,
 			       struct module *owner, unsigned long val);
@@ -718,7 +722,13 @@ static bool strstarts(const char *str, const char *prefix);
 static bool singular(struct list_head *list);
 static void *bsearch(const void *key, const void *base, size_t n,
 		     size_t size, int (*cmp)(const void *key, const void *elt));
-static int compare_relocs(const void *a, const void *b);
+static bool is_sorted(const void *base, size_t n, size_t size,
+		      int (*cmp)(const void *a, const void *b));
+static void sort_presorted(const struct ksplice_code *code, unsigned int flag,
+			   void *base, size_t n, size_t size,
+			   int (*cmp)(const void *a, const void *b));
+static int decode_reloc_table(struct ksplice_code *code);
+static void free_relocs(struct ksplice_code *code);
 static int reloc_bsearch_compare(const void *key, const void *elt);
 
 /* Debugging */
@@ -812,22 +822,35 @@ int init_ksplice_mod_change(struct ksplice_mod_change *change)
 	INIT_LIST_HEAD(&change->temp_labelvals);
 	INIT_LIST_HEAD(&change->safety_records);
 
-	sort(change->old_code.relocs,
-	     change->old_code.relocs_end - change->old_code.relocs,
-	     sizeof(*change->old_code.relocs), compare_relocs, NULL);
-	sort(change->new_code.relocs,
-	     change->new_code.relocs_end - change->new_code.relocs,
-	     sizeof(*change->new_code.relocs), compare_relocs, NULL);
-	sort(change->old_code.sections,
-	     change->old_code.sections_end - change->old_code.sections,
-	     sizeof(*change->old_code.sections), compare_section_labels, NULL);
+	ret = check_symbol_hash(&change->old_code);
+	if (ret == 0)
+		ret = check_symbol_hash(&change->new_code);
+	if (ret != 0)
+		return ret;
+	ret = decode_reloc_table(&change->old_code);
+	if (ret != 0)
+		return ret;
+	ret = decode_reloc_table(&change->new_code);
+	if (ret != 0)
+		goto out_relocs;
+	sort_presorted(&change->old_code, KSPLICE_SORTED_SECTIONS,
+		       change->old_code.sections,
+		       change->old_code.sections_end - change->old_code.sections,
+		       sizeof(*change->old_code.sections),
+		       compare_section_labels);
 #ifdef KSPLICE_STANDALONE
-	sort(change->new_code.system_map,
-	     change->new_code.system_map_end - change->new_code.system_map,
-	     sizeof(*change->new_code.system_map), compare_system_map, NULL);
-	sort(change->old_code.system_map,
-	     change->old_code.system_map_end - change->old_code.system_map,
-	     sizeof(*change->old_code.system_map), compare_system_map, NULL);
+	sort_presorted(&change->new_code, KSPLICE_SORTED_SYSTEM_MAP,
+		       change->new_code.system_map,
+		       change->new_code.system_map_end -
+		       change->new_code.system_map,
+		       sizeof(*change->new_code.system_map),
+		       compare_system_map);
+	sort_presorted(&change->old_code, KSPLICE_SORTED_SYSTEM_MAP,
+		       change->old_code.system_map,
+		       change->old_code.system_map_end -
+		       change->old_code.system_map,
+		       sizeof(*change->old_code.system_map),
+		       compare_system_map);
 #endif /* KSPLICE_STANDALONE */
 
 	for (p = change->patches; p < change->patches_end; p++)
@@ -837,12 +860,16 @@ int init_ksplice_mod_change(struct ksplice_mod_change *change)
 		s->match_map = NULL;
 	for (p = change->patches; p < change->patches_end; p++) {
 		const struct ksplice_reloc *r = patch_reloc(change, p);
-		if (r == NULL)
-			return -ENOENT;
+		if (r == NULL) {
+			ret = -ENOENT;
+			goto out_relocs;
+		}
 		if (p->type == KSPLICE_PATCH_DATA) {
 			s = symbol_section(change, r->symbol);
-			if (s == NULL)
-				return -ENOENT;
+			if (s == NULL) {
+				ret = -ENOENT;
+				goto out_relocs;
+			}
 			/* Ksplice creates KSPLICE_PATCH_DATA patches in order
 			 * to modify rodata sections that have been explicitly
 			 * marked for patching using the ksplice-patch.h macro
@@ -880,6 +907,9 @@ int init_ksplice_mod_change(struct ksplice_mod_change *change)
 	add_to_update(change, update);
 out:
 	mutex_unlock(&module_mutex);
+out_relocs:
+	if (ret != 0)
+		free_relocs(&change->old_code);
 	return ret;
 }
 EXPORT_SYMBOL_GPL(init_ksplice_mod_change);
@@ -897,8 +927,10 @@ EXPORT_SYMBOL_GPL(init_ksplice_mod_change);
  */
 void cleanup_ksplice_mod_change(struct ksplice_mod_change *change)
 {
-	if (change->update == NULL)
+	if (change->update == NULL) {
+		free_relocs(&change->new_code);
 		return;
+	}
 
 	mutex_lock(&module_mutex);
 	if (change->update->stage == STAGE_APPLIED) {
@@ -912,6 +944,7 @@ void cleanup_ksplice_mod_change(struct ksplice_mod_change *change)
 		if (found)
 			list_del(&change->list);
 		mutex_unlock(&module_mutex);
+		free_relocs(&change->old_code);
 		return;
 	}
 	list_del(&change->list);
@@ -919,6 +952,8 @@ void cleanup_ksplice_mod_change(struct ksplice_mod_change *change)
 		maybe_cleanup_ksplice_update(change->update);
 	change->update = NULL;
 	mutex_unlock(&module_mutex);
+	free_relocs(&change->old_code);
+	free_relocs(&change->new_code);
 }
 EXPORT_SYMBOL_GPL(cleanup_ksplice_mod_change);
 
@@ -1164,53 +1199,81 @@ static abort_t reverse_update(struct update *update)
 	return OK;
 }
 
-static int compare_symbolp_names(const void *a, const void *b)
+/*
+ * check_symbol_hash() - Checks that code->symbol_hash covers code->symbols
+ *
+ * The symbol hash tables written by objmanip let us look up an object's
+ * ksplice_symbols by label or by name without sorting them first.
+ */
+static int check_symbol_hash(const struct ksplice_code *code)
 {
-	const struct ksplice_symbol *const *sympa = a, *const *sympb = b;
-	if ((*sympa)->name == NULL && (*sympb)->name == NULL)
-		return 0;
-	if ((*sympa)->name == NULL)
-		return -1;
-	if ((*sympb)->name == NULL)
-		return 1;
-	return strcmp((*sympa)->name, (*sympb)->name);
+	const struct ksplice_symbol_hash *hash = code->symbol_hash;
+	const unsigned char *end = (const unsigned char *)code->symbol_hash_end;
+	unsigned long nr_symbols = code->symbols_end - code->symbols;
+	unsigned long nr_chains;
+	const unsigned int *p;
+
+	if ((const unsigned char *)(hash + 1) > end ||
+	    hash->nr_symbols != nr_symbols || hash->nr_buckets == 0 ||
+	    (hash->nr_buckets & (hash->nr_buckets - 1)) != 0)
+		return -EINVAL;
+	nr_chains = 2 * (unsigned long)hash->nr_buckets + 2 * nr_symbols;
+	if (nr_chains > (end - (const unsigned char *)hash->chains) /
+	    sizeof(*hash->chains))
+		return -EINVAL;
+	for (p = hash->chains; p < hash->chains + nr_chains; p++) {
+		if (*p != KSPLICE_SYMBOL_HASH_END && *p >= nr_symbols)
+			return -EINVAL;
+	}
+	return 0;
 }
 
-static int compare_symbolp_labels(const void *a, const void *b)
+static unsigned int *symbol_hash_bucket(const struct ksplice_code *code,
+					const char *str, bool by_name)
 {
-	const struct ksplice_symbol *const *sympa = a, *const *sympb = b;
-	return strcmp((*sympa)->label, (*sympb)->label);
+	struct ksplice_symbol_hash *hash = code->symbol_hash;
+	unsigned int *buckets = hash->chains;
+	if (by_name)
+		buckets += hash->nr_buckets;
+	return &buckets[ksplice_string_hash(str) & (hash->nr_buckets - 1)];
 }
 
-static int symbolp_bsearch_compare(const void *key, const void *elt)
+static unsigned int *symbol_hash_next(const struct ksplice_code *code,
+				      unsigned int i, bool by_name)
 {
-	const char *name = key;
-	const struct ksplice_symbol *const *symp = elt;
-	const struct ksplice_symbol *sym = *symp;
-	if (sym->name == NULL)
-		return 1;
-	return strcmp(name, sym->name);
+	struct ksplice_symbol_hash *hash = code->symbol_hash;
+	unsigned int *next = hash->chains + 2 * hash->nr_buckets;
+	if (by_name)
+		next += hash->nr_symbols;
+	return &next[i];
+}
+
+static struct ksplice_symbol *label_symbol(const struct ksplice_code *code,
+					   const char *label)
+{
+	unsigned int i;
+	for (i = *symbol_hash_bucket(code, label, false);
+	     i != KSPLICE_SYMBOL_HASH_END;
+	     i = *symbol_hash_next(code, i, false)) {
+		if (strcmp(code->symbols[i].label, label) == 0)
+			return &code->symbols[i];
+	}
+	return NULL;
 }
 
 static abort_t add_matching_values(struct ksplice_lookup *lookup,
 				   const char *sym_name, unsigned long sym_val)
 {
-	struct ksplice_symbol **symp;
+	struct ksplice_code *code = lookup->code;
+	unsigned int i;
 	abort_t ret;
 
-	symp = bsearch(sym_name, lookup->arr, lookup->size,
-		       sizeof(*lookup->arr), symbolp_bsearch_compare);
-	if (symp == NULL)
-		return OK;
-
-	while (symp > lookup->arr &&
-	       symbolp_bsearch_compare(sym_name, symp - 1) == 0)
-		symp--;
-
-	for (; symp < lookup->arr + lookup->size; symp++) {
-		struct ksplice_symbol *sym = *symp;
-		if (sym->name == NULL || strcmp(sym_name, sym->name) != 0)
-			break;
+	for (i = *symbol_hash_bucket(code, sym_name, true);
+	     i != KSPLICE_SYMBOL_HASH_END;
+	     i = *symbol_hash_next(code, i, true)) {
+		struct ksplice_symbol *sym = &code->symbols[i];
+		if (strcmp(sym_name, sym->name) != 0)
+			continue;
 		ret = add_candidate_val(lookup->change,
 					sym->candidate_vals, sym_val);
 		if (ret != OK)
@@ -1280,66 +1343,52 @@ static abort_t uniquify_symbols(struct ksplice_mod_change *change)
 {
 	struct ksplice_reloc *r;
 	struct ksplice_section *s;
-	struct ksplice_symbol *sym, **sym_arr, **symp;
-	size_t size = change->new_code.symbols_end - change->new_code.symbols;
 
-	if (size == 0)
+	if (change->new_code.symbols == change->new_code.symbols_end)
 		return OK;
 
-	sym_arr = vmalloc(sizeof(*sym_arr) * size);
-	if (sym_arr == NULL)
-		return OUT_OF_MEMORY;
-
-	for (symp = sym_arr, sym = change->new_code.symbols;
-	     symp < sym_arr + size && sym < change->new_code.symbols_end;
-	     sym++, symp++)
-		*symp = sym;
-
-	sort(sym_arr, size, sizeof(*sym_arr), compare_symbolp_labels, NULL);
-
 	for (r = change->old_code.relocs; r < change->old_code.relocs_end;
-	     r++) {
-		symp = bsearch(&r->symbol, sym_arr, size, sizeof(*sym_arr),
-			       compare_symbolp_labels);
-		if (symp != NULL) {
-			if ((*symp)->name == NULL)
-				(*symp)->name = r->symbol->name;
-			r->symbol = *symp;
-		}
-	}
-
+	     r++)
+		unify_symbol(&change->new_code, &r->symbol);
 	for (s = change->old_code.sections; s < change->old_code.sections_end;
-	     s++) {
-		symp = bsearch(&s->symbol, sym_arr, size, sizeof(*sym_arr),
-			       compare_symbolp_labels);
-		if (symp != NULL) {
-			if ((*symp)->name == NULL)
-				(*symp)->name = s->symbol->name;
-			s->symbol = *symp;
-		}
-	}
-
-	vfree(sym_arr);
+	     s++)
+		unify_symbol(&change->new_code, &s->symbol);
 	return OK;
 }
 
+static void unify_symbol(struct ksplice_code *code,
+			 struct ksplice_symbol **symp)
+{
+	struct ksplice_symbol *sym = label_symbol(code, (*symp)->label);
+	unsigned int *bucket;
+
+	if (sym == NULL)
+		return;
+	if (sym->name == NULL && (*symp)->name != NULL) {
+		/* The name is new to sym, so add it to the name table */
+		sym->name = (*symp)->name;
+		bucket = symbol_hash_bucket(code, sym->name, true);
+		*symbol_hash_next(code, sym - code->symbols, true) = *bucket;
+		*bucket = sym - code->symbols;
+	}
+	*symp = sym;
+}
+
 /*
- * Initialize the ksplice_symbol structures in the given array using
+ * Initialize the ksplice_symbol structures of the given code using
  * the kallsyms and exported symbol tables.
  */
 static abort_t init_symbol_array(struct ksplice_mod_change *change,
-				 struct ksplice_symbol *start,
-				 struct ksplice_symbol *end)
+				 struct ksplice_code *code)
 {
-	struct ksplice_symbol *sym, **sym_arr, **symp;
+	struct ksplice_symbol *sym;
 	struct ksplice_lookup lookup;
-	size_t size = end - start;
 	abort_t ret;
 
-	if (size == 0)
+	if (code->symbols == code->symbols_end)
 		return OK;
 
-	for (sym = start; sym < end; sym++) {
+	for (sym = code->symbols; sym < code->symbols_end; sym++) {
 		if (strstarts(sym->label, "__ksymtab")) {
 			const struct kernel_symbol *ksym;
 			const char *colon = strchr(sym->label, ':');
@@ -1365,19 +1414,8 @@ static abort_t init_symbol_array(struct ksplice_mod_change *change,
 		sym->value = 0;
 	}
 
-	sym_arr = vmalloc(sizeof(*sym_arr) * size);
-	if (sym_arr == NULL)
-		return OUT_OF_MEMORY;
-
-	for (symp = sym_arr, sym = start; symp < sym_arr + size && sym < end;
-	     sym++, symp++)
-		*symp = sym;
-
-	sort(sym_arr, size, sizeof(*sym_arr), compare_symbolp_names, NULL);
-
 	lookup.change = change;
-	lookup.arr = sym_arr;
-	lookup.size = size;
+	lookup.code = code;
 	lookup.ret = OK;
 
 	each_symbol(add_export_values, &lookup);
@@ -1387,7 +1425,6 @@ static abort_t init_symbol_array(struct ksplice_mod_change *change,
 		ret = (__force abort_t)
 		    kallsyms_on_each_symbol(add_kallsyms_values, &lookup);
 #endif /* CONFIG_KALLSYMS */
-	vfree(sym_arr);
 	return ret;
 }
 
@@ -1404,13 +1441,11 @@ static noinline abort_t init_symbol_arrays(struct ksplice_mod_change *change)
 	if (ret != OK)
 		return ret;
 
-	ret = init_symbol_array(change, change->old_code.symbols,
-				change->old_code.symbols_end);
+	ret = init_symbol_array(change, &change->old_code);
 	if (ret != OK)
 		return ret;
 
-	ret = init_symbol_array(change, change->new_code.symbols,
-				change->new_code.symbols_end);
+	ret = init_symbol_array(change, &change->new_code);
 	if (ret != OK)
 		return ret;
 
@@ -3607,15 +3642,182 @@ static void *bsearch(const void *key, const void *base, size_t n,
 	return NULL;
 }
 
-static int compare_relocs(const void *a, const void *b)
+struct reloc_stream {
+	const struct ksplice_reloc_run *run;
+	const unsigned char *data;
+};
+
+static int compare_reloc_streams(const void *a, const void *b)
 {
-	const struct ksplice_reloc *ra = a, *rb = b;
-	if (ra->blank_addr > rb->blank_addr)
+	const struct reloc_stream *sa = a, *sb = b;
+	if (sa->run->base > sb->run->base)
 		return 1;
-	else if (ra->blank_addr < rb->blank_addr)
+	else if (sa->run->base < sb->run->base)
 		return -1;
 	else
-		return ra->howto->size - rb->howto->size;
+		return 0;
+}
+
+/* Returns NULL if p is NULL or the number does not fit before end */
+static const unsigned char *read_uleb128(const unsigned char *p,
+					 const unsigned char *end,
+					 unsigned long *val)
+{
+	int shift = 0;
+	*val = 0;
+	do {
+		if (p == NULL || p >= end || shift >= BITS_PER_LONG)
+			return NULL;
+		*val |= (unsigned long)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
+static const unsigned char *read_sleb128(const unsigned char *p,
+					 const unsigned char *end, long *val)
+{
+	unsigned long uval = 0;
+	unsigned char byte;
+	int shift = 0;
+	do {
+		if (p == NULL || p >= end || shift >= BITS_PER_LONG)
+			return NULL;
+		byte = *p++;
+		uval |= (unsigned long)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < BITS_PER_LONG && (byte & 0x40) != 0)
+		uval |= ~0UL << shift;
+	*val = uval;
+	return p;
+}
+
+static bool is_sorted(const void *base, size_t n, size_t size,
+		      int (*cmp)(const void *a, const void *b))
+{
+	const char *p;
+	if (n < 2)
+		return true;
+	for (p = base; p < (const char *)base + (n - 1) * size; p += size) {
+		if (cmp(p, p + size) > 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * sort_presorted() - Sorts an array of an object's Ksplice metadata
+ *
+ * If objmanip set flag in code->reloc_table, it already wrote the array
+ * in sorted order, and we only check that in linear time.
+ */
+static void sort_presorted(const struct ksplice_code *code, unsigned int flag,
+			   void *base, size_t n, size_t size,
+			   int (*cmp)(const void *a, const void *b))
+{
+	const struct ksplice_reloc_table *table = code->reloc_table;
+	if ((const void *)table != (const void *)code->reloc_table_end &&
+	    table->version == KSPLICE_RELOC_TABLE_VERSION &&
+	    (table->flags & flag) != 0 && is_sorted(base, n, size, cmp))
+		return;
+	sort(base, n, size, cmp, NULL);
+}
+
+/*
+ * decode_reloc_table() - Decodes an object's Ksplice relocations
+ *
+ * The relocations within each run of code->reloc_table are already sorted
+ * by objmanip, so sorting the runs by their base addresses leaves
+ * code->relocs sorted as find_reloc requires.  The runs are in section
+ * order, which is usually also address order once the module is loaded.
+ */
+static int decode_reloc_table(struct ksplice_code *code)
+{
+	const struct ksplice_reloc_table *table = code->reloc_table;
+	const unsigned char *end = (const unsigned char *)code->reloc_table_end;
+	const struct ksplice_reloc_run *runs;
+	const unsigned char *p;
+	struct reloc_stream *streams;
+	struct ksplice_reloc *r;
+	unsigned long nr_symbols = code->symbols_end - code->symbols;
+	unsigned long addr, delta, howto, symbol;
+	unsigned int i, j;
+	int ret = -EINVAL;
+
+	if (code->relocs != NULL || (const unsigned char *)table == end)
+		return 0;
+	if ((const unsigned char *)(table + 1) > end ||
+	    table->version != KSPLICE_RELOC_TABLE_VERSION)
+		return -EINVAL;
+	runs = (const struct ksplice_reloc_run *)
+	    (table->howtos + table->nr_howtos);
+	p = (const unsigned char *)(runs + table->nr_runs);
+	if (p > end)
+		return -EINVAL;
+	if (table->nr_relocs == 0)
+		return 0;
+
+	streams = vmalloc(table->nr_runs * sizeof(*streams));
+	if (streams == NULL)
+		return -ENOMEM;
+	for (i = 0; i < table->nr_runs; i++) {
+		streams[i].run = &runs[i];
+		streams[i].data = p;
+		p += runs[i].size;
+	}
+	if (p > end)
+		goto out;
+	if (!is_sorted(streams, table->nr_runs, sizeof(*streams),
+		       compare_reloc_streams))
+		sort(streams, table->nr_runs, sizeof(*streams),
+		     compare_reloc_streams, NULL);
+
+	code->relocs = vmalloc(table->nr_relocs * sizeof(*code->relocs));
+	if (code->relocs == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	r = code->relocs;
+	for (i = 0; i < table->nr_runs; i++) {
+		const struct ksplice_reloc_run *run = streams[i].run;
+		const unsigned char *run_end = streams[i].data + run->size;
+		if (run->nr_relocs > code->relocs + table->nr_relocs - r)
+			goto fail;
+		p = streams[i].data;
+		addr = run->base;
+		for (j = 0; j < run->nr_relocs; j++, r++) {
+			p = read_uleb128(p, run_end, &delta);
+			p = read_uleb128(p, run_end, &howto);
+			p = read_uleb128(p, run_end, &symbol);
+			p = read_sleb128(p, run_end, &r->insn_addend);
+			p = read_sleb128(p, run_end, &r->target_addend);
+			if (p == NULL || howto >= table->nr_howtos ||
+			    symbol >= nr_symbols)
+				goto fail;
+			addr += delta;
+			r->blank_addr = addr;
+			r->howto = &table->howtos[howto];
+			r->symbol = &code->symbols[symbol];
+		}
+	}
+	if (r != code->relocs + table->nr_relocs)
+		goto fail;
+	code->relocs_end = r;
+	ret = 0;
+	goto out;
+fail:
+	free_relocs(code);
+out:
+	vfree(streams);
+	return ret;
+}
+
+static void free_relocs(struct ksplice_code *code)
+{
+	vfree(code->relocs);
+	code->relocs = NULL;
+	code->relocs_end = NULL;
 }
 
 #ifdef KSPLICE_STANDALONE
@@ -15,6 +15,36 @@ struct ksplice_symbol {
 	unsigned long value;
 };
 
+#define KSPLICE_SYMBOL_HASH_END 0xffffffffU
+
+/**
+ * struct ksplice_symbol_hash - Hash tables over an object's ksplice_symbols
+ * @nr_buckets:		The number of buckets in each table; a power of two
+ * @nr_symbols:		The number of ksplice_symbols in the tables
+ * @chains:		The label buckets, the name buckets, the label chains
+ *			and the name chains, in that order
+ *
+ * A bucket holds the index of the first symbol whose label (or name)
+ * hashes to it under ksplice_string_hash, and the chain entry for a
+ * symbol holds the index of the next such symbol, with
+ * KSPLICE_SYMBOL_HASH_END ending the list.  Symbols without a name are
+ * not in the name table.
+ **/
+struct ksplice_symbol_hash {
+	unsigned int nr_buckets;
+	unsigned int nr_symbols;
+	unsigned int chains[];
+};
+
+/* The 32-bit FNV-1a hash, shared by objmanip and the kernel */
+static inline unsigned int ksplice_string_hash(const char *str)
+{
+	unsigned int hash = 2166136261U;
+	for (; *str != '\0'; str++)
+		hash = (hash ^ (unsigned char)*str) * 16777619U;
+	return hash;
+}
+
 /**
  * struct ksplice_reloc - Ksplice's analogue of an ELF relocation
  * @blank_addr:		The address of the relocation's storage unit
@@ -66,6 +96,51 @@ struct ksplice_reloc_howto {
 	int signed_addend;
 };
 
+#define KSPLICE_RELOC_TABLE_VERSION 2
+
+#define KSPLICE_SORTED_SECTIONS 0x00000001
+#define KSPLICE_SORTED_SYSTEM_MAP 0x00000002
+
+/**
+ * struct ksplice_reloc_table - The encoded Ksplice relocations for an object
+ * @version:		KSPLICE_RELOC_TABLE_VERSION
+ * @flags:		KSPLICE_SORTED_* flags for the arrays that objmanip has
+ *			already sorted as init_ksplice_mod_change needs
+ * @nr_howtos:		The number of entries in howtos
+ * @nr_runs:		The number of ksplice_reloc_runs following the howtos
+ * @nr_relocs:		The total number of relocations in all of the runs
+ * @howtos:		The distinct relocation types used by the object
+ *
+ * The runs are followed by their encoded relocations, one run after
+ * another.  Each relocation is five LEB128 numbers: the distance of its
+ * blank_addr from that of the previous relocation in the run (or from
+ * the run's base), the index of its howto, the index of its symbol in
+ * the object's ksplice_symbols, its insn_addend and its target_addend.
+ * The last two are signed.
+ **/
+struct ksplice_reloc_table {
+	unsigned int version;
+	unsigned int flags;
+	unsigned int nr_howtos;
+	unsigned int nr_runs;
+	unsigned int nr_relocs;
+	struct ksplice_reloc_howto howtos[];
+};
+
+/**
+ * struct ksplice_reloc_run - The relocations of one section of an object
+ * @base:		The address of the section
+ * @nr_relocs:		The number of relocations in the run
+ * @size:		The length, in bytes, of the encoded relocations
+ *
+ * The relocations in a run are sorted by blank_addr and then by size.
+ **/
+struct ksplice_reloc_run {
+	unsigned long base;
+	unsigned int nr_relocs;
+	unsigned int size;
+};
+
 #if BITS_PER_LONG == 32
 #define KSPLICE_CANARY 0x77777777UL
 #elif BITS_PER_LONG == 64
@@ -211,14 +286,19 @@ struct ksplice_hooks {
 
 /**
  * struct ksplice_code - Ksplice metadata for an object
- * @relocs:		The Ksplice relocations for the object
+ * @reloc_table:	The encoded Ksplice relocations for the object
+ * @relocs:		The Ksplice relocations for the object, sorted;
+ *			decoded from reloc_table by init_ksplice_mod_change
  * @symbols:		The Ksplice symbols for the object
+ * @symbol_hash:	Hash tables over the labels and names of symbols
  * @sections:		The Ksplice sections for the object
  **/
 struct ksplice_code {
+	const struct ksplice_reloc_table *reloc_table, *reloc_table_end;
 	struct ksplice_reloc *relocs, *relocs_end;
 	struct ksplice_section *sections, *sections_end;
 	struct ksplice_symbol *symbols, *symbols_end;
+	struct ksplice_symbol_hash *symbol_hash, *symbol_hash_end;
 #ifdef KSPLICE_NEED_PARAINSTRUCTIONS
 	struct paravirt_patch_site *parainstructions, *parainstructions_end;
 #endif /* KSPLICE_NEED_PARAINSTRUCTIONS */
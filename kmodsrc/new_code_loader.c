@@ -21,9 +21,12 @@
 #include <linux/ksplice.h>
 #endif
 
-extern struct ksplice_reloc ksplice_relocs[], ksplice_relocs_end[];
+extern const struct ksplice_reloc_table ksplice_reloc_table[],
+    ksplice_reloc_table_end[];
 extern struct ksplice_section ksplice_sections[], ksplice_sections_end[];
 extern struct ksplice_symbol ksplice_symbols[], ksplice_symbols_end[];
+extern struct ksplice_symbol_hash ksplice_symbol_hash[],
+    ksplice_symbol_hash_end[];
 extern struct ksplice_patch ksplice_patches[], ksplice_patches_end[];
 extern const typeof(int (*)(void)) ksplice_call_pre_apply[],
     ksplice_call_pre_apply_end[], ksplice_call_check_apply[],
@@ -57,12 +60,14 @@ struct ksplice_mod_change change = {
 #endif /* KSPLICE_STANDALONE */
 	.new_code_mod = THIS_MODULE,
 	.new_code = {
-		.relocs = ksplice_relocs,
-		.relocs_end = ksplice_relocs_end,
+		.reloc_table = ksplice_reloc_table,
+		.reloc_table_end = ksplice_reloc_table_end,
 		.sections = ksplice_sections,
 		.sections_end = ksplice_sections_end,
 		.symbols = ksplice_symbols,
 		.symbols_end = ksplice_symbols_end,
+		.symbol_hash = ksplice_symbol_hash,
+		.symbol_hash_end = ksplice_symbol_hash_end,
 #ifdef KSPLICE_NEED_PARAINSTRUCTIONS
 		.parainstructions = parainstructions,
 		.parainstructions_end = parainstructions_end,
@@ -17,34 +17,246 @@
 
 #define _GNU_SOURCE
 #include "objcommon.h"
+#include <pthread.h>
 #include <stdio.h>
-
-#define arelentp_init(x) *(x) = NULL
-IMPLEMENT_HASH_TYPE(arelent *, arelentp_hash, arelentp_hash_init,
-		    arelentp_hash_free, arelentp_hash_lookup, arelentp_init);
+#include <unistd.h>
 
 #define label_mapp_init(map) *(map) = NULL
 IMPLEMENT_HASH_TYPE(struct label_map *, label_mapp_hash, label_mapp_hash_init,
 		    label_mapp_hash_free, label_mapp_hash_lookup,
 		    label_mapp_init);
+IMPLEMENT_ADDR_HASH_TYPE(struct label_map *, label_mapp_addr_hash,
+			 label_mapp_addr_hash_init, label_mapp_addr_hash_free,
+			 label_mapp_addr_hash_lookup, label_mapp_init);
 
 #define asymbolpp_init(symp) *(symp) = NULL
-IMPLEMENT_HASH_TYPE(asymbol **, asymbolpp_hash, asymbolpp_hash_init,
-		    asymbolpp_hash_free, asymbolpp_hash_lookup, asymbolpp_init);
+IMPLEMENT_ADDR_HASH_TYPE(asymbol **, asymbolpp_addr_hash,
+			 asymbolpp_addr_hash_init, asymbolpp_addr_hash_free,
+			 asymbolpp_addr_hash_lookup, asymbolpp_init);
 
 #define string_init(str) *(str) = NULL
 IMPLEMENT_HASH_TYPE(const char *, string_hash, string_hash_init,
 		    string_hash_free, string_hash_lookup, string_init);
+IMPLEMENT_ADDR_HASH_TYPE(const char *, string_addr_hash, string_addr_hash_init,
+			 string_addr_hash_free, string_addr_hash_lookup,
+			 string_init);
+
+IMPLEMENT_HASH_TYPE(struct asymbolp_vec, asymbolp_vec_hash,
+		    asymbolp_vec_hash_init, asymbolp_vec_hash_free,
+		    asymbolp_vec_hash_lookup, vec_init);
+IMPLEMENT_ADDR_HASH_TYPE(struct asymbolp_vec, asymbolp_vec_addr_hash,
+			 asymbolp_vec_addr_hash_init,
+			 asymbolp_vec_addr_hash_free,
+			 asymbolp_vec_addr_hash_lookup, vec_init);
+
+#define ulong_addr_init(x) *(x) = ULONG_MAX
+IMPLEMENT_ADDR_HASH_TYPE(unsigned long, ulong_addr_hash, ulong_addr_hash_init,
+			 ulong_addr_hash_free, ulong_addr_hash_lookup,
+			 ulong_addr_init);
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+/* Allocations at least this large get a chunk of their own */
+#define ARENA_LARGE (ARENA_CHUNK_SIZE / 4)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *prev, *next;
+	unsigned long seq;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/* All chunks, newest first; only changed under arena_lock */
+static struct arena_chunk *arena_chunks;
+static unsigned long arena_seq;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Each thread bumps its own chunk, so parallel_for callbacks can allocate */
+static __thread struct arena_chunk *arena_current, *arena_last_chunk;
+static __thread char *arena_last;
+
+static struct arena_chunk *arena_new_chunk(size_t size)
+{
+	struct arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+	assert(chunk != NULL);
+	chunk->prev = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	pthread_mutex_lock(&arena_lock);
+	chunk->seq = ++arena_seq;
+	chunk->next = arena_chunks;
+	if (arena_chunks != NULL)
+		arena_chunks->prev = chunk;
+	arena_chunks = chunk;
+	pthread_mutex_unlock(&arena_lock);
+	return chunk;
+}
+
+static void arena_unlink_chunk(struct arena_chunk *chunk)
+{
+	if (chunk->prev != NULL)
+		chunk->prev->next = chunk->next;
+	else
+		arena_chunks = chunk->next;
+	if (chunk->next != NULL)
+		chunk->next->prev = chunk->prev;
+}
+
+void *arena_alloc(size_t size)
+{
+	if (size >= ARENA_LARGE) {
+		struct arena_chunk *chunk = arena_new_chunk(size);
+		chunk->used = size;
+		return chunk->data;
+	}
+
+	struct arena_chunk *chunk = arena_current;
+	size_t start = chunk != NULL ? align(chunk->used, ARENA_ALIGN) : 0;
+	if (chunk == NULL || start + size > chunk->size) {
+		chunk = arena_current = arena_new_chunk(ARENA_CHUNK_SIZE);
+		start = 0;
+	}
+	chunk->used = start + size;
+	arena_last_chunk = chunk;
+	arena_last = chunk->data + start;
+	return arena_last;
+}
+
+/* Resize a large allocation's own chunk, keeping its place in the list */
+static void *arena_resize_chunk(void *ptr, size_t new_size)
+{
+	struct arena_chunk *chunk = (struct arena_chunk *)
+	    ((char *)ptr - offsetof(struct arena_chunk, data));
+	pthread_mutex_lock(&arena_lock);
+	struct arena_chunk *prev = chunk->prev;
+	arena_unlink_chunk(chunk);
+	chunk = realloc(chunk, sizeof(*chunk) + new_size);
+	assert(chunk != NULL);
+	chunk->size = chunk->used = new_size;
+	chunk->prev = prev;
+	chunk->next = prev != NULL ? prev->next : arena_chunks;
+	if (prev != NULL)
+		prev->next = chunk;
+	else
+		arena_chunks = chunk;
+	if (chunk->next != NULL)
+		chunk->next->prev = chunk;
+	pthread_mutex_unlock(&arena_lock);
+	return chunk->data;
+}
+
+/*
+ * Shrinking only gives memory back for large allocations, which have a
+ * chunk of their own; small ones keep their bytes until arena_release.
+ */
+void *arena_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+	if (ptr == NULL)
+		return arena_alloc(new_size);
+	if (new_size <= old_size && old_size < ARENA_LARGE)
+		return ptr;
+
+	if (old_size >= ARENA_LARGE && new_size >= ARENA_LARGE)
+		return arena_resize_chunk(ptr, new_size);
+
+	if (ptr == arena_last && new_size < ARENA_LARGE &&
+	    arena_last - arena_last_chunk->data + new_size <=
+	    arena_last_chunk->size) {
+		arena_last_chunk->used = arena_last - arena_last_chunk->data +
+		    new_size;
+		return ptr;
+	}
+	void *new = NULL;
+	if (new_size != 0) {
+		new = arena_alloc(new_size);
+		memcpy(new, ptr, old_size < new_size ? old_size : new_size);
+	}
+	arena_free(ptr, old_size);
+	return new;
+}
+
+void arena_free(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+	if (size >= ARENA_LARGE) {
+		struct arena_chunk *chunk = (struct arena_chunk *)
+		    ((char *)ptr - offsetof(struct arena_chunk, data));
+		pthread_mutex_lock(&arena_lock);
+		arena_unlink_chunk(chunk);
+		pthread_mutex_unlock(&arena_lock);
+		free(chunk);
+	} else if (ptr == arena_last) {
+		arena_last_chunk->used = arena_last - arena_last_chunk->data;
+		arena_last = NULL;
+	}
+}
+
+/* Must not be called while parallel_for is running */
+void arena_mark(struct arena_mark *mark)
+{
+	mark->seq = arena_seq;
+	mark->current = arena_current;
+	mark->used = arena_current != NULL ? arena_current->used : 0;
+}
+
+/* Free everything allocated since arena_mark(mark) */
+void arena_release(const struct arena_mark *mark)
+{
+	struct arena_chunk *chunk, *next;
+	for (chunk = arena_chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		if (chunk->seq > mark->seq) {
+			arena_unlink_chunk(chunk);
+			free(chunk);
+		}
+	}
+	arena_current = mark->current;
+	if (arena_current != NULL)
+		arena_current->used = mark->used;
+	arena_last = NULL;
+}
 
 void vec_do_reserve(void **data, size_t *mem_size, size_t new_size)
 {
-	if (new_size > *mem_size || new_size * 2 < *mem_size) {
+	if (new_size > *mem_size) {
 		if (new_size < *mem_size * 2)
 			new_size = *mem_size * 2;
-		*data = realloc(*data, new_size);
-		assert(new_size == 0 || *data != NULL);
-		*mem_size = new_size;
+	} else if (new_size * 2 >= *mem_size || *mem_size < ARENA_LARGE) {
+		return;
 	}
+	*data = arena_realloc(*data, *mem_size, new_size);
+	*mem_size = new_size;
+}
+
+/*
+ * Strings that are compared often, such as labels and symbol names, are
+ * interned so that equal strings are the same pointer.  The table lives
+ * outside the arena, so interned strings survive arena_release.
+ */
+static struct bfd_hash_table interned_strings;
+
+const char *intern(const char *str)
+{
+	if (interned_strings.table == NULL)
+		assert(bfd_hash_table_init(&interned_strings, bfd_hash_newfunc,
+					   sizeof(struct bfd_hash_entry)));
+	struct bfd_hash_entry *e =
+	    bfd_hash_lookup(&interned_strings, str, TRUE, TRUE);
+	assert(e != NULL);
+	return e->string;
+}
+
+const char *internf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	char *str = vstrprintf(fmt, ap);
+	va_end(ap);
+	const char *interned = intern(str);
+	arena_free(str, strlen(str) + 1);
+	return interned;
 }
 
 void get_syms(bfd *abfd, struct asymbolp_vec *syms)
@@ -58,6 +270,51 @@ void get_syms(bfd *abfd, struct asymbolp_vec *syms)
 	vec_reserve(syms, storage_needed);
 	vec_resize(syms, bfd_canonicalize_symtab(abfd, syms->data));
 	assert(syms->size >= 0);
+
+	asymbol **symp;
+	for (symp = syms->data; symp < syms->data + syms->size; symp++)
+		(*symp)->name = intern((*symp)->name);
+}
+
+/*
+ * Bucket the symbol table by section.  Buckets keep symbol table order,
+ * which is the order fetch_supersect and compute_system_map_array saw
+ * when they scanned the whole table.
+ */
+static void init_sym_index(struct superbfd *sbfd)
+{
+	asymbolp_vec_addr_hash_init(&sbfd->syms_by_section);
+	ulong_addr_hash_init(&sbfd->sym_index);
+
+	unsigned long i;
+	for (i = 0; i < sbfd->syms.size; i++) {
+		asymbol *sym = sbfd->syms.data[i];
+		unsigned long *index =
+		    ulong_addr_hash_lookup(&sbfd->sym_index, sym, 0, TRUE);
+		if (*index == ULONG_MAX)
+			*index = i;
+		*vec_grow(asymbolp_vec_addr_hash_lookup(&sbfd->syms_by_section,
+							sym->section, 0, TRUE),
+			  1) = sym;
+	}
+}
+
+/* The symbols in sect, in symbol table order */
+struct asymbolp_vec *section_syms(struct superbfd *sbfd, asection *sect)
+{
+	static struct asymbolp_vec no_syms;
+	struct asymbolp_vec *syms =
+	    asymbolp_vec_addr_hash_lookup(&sbfd->syms_by_section, sect, 0,
+					  FALSE);
+	return syms != NULL ? syms : &no_syms;
+}
+
+/* The entry for sym in sbfd->syms, or NULL */
+asymbol **fetch_symbolp(struct superbfd *sbfd, asymbol *sym)
+{
+	unsigned long *index =
+	    ulong_addr_hash_lookup(&sbfd->sym_index, sym, 0, FALSE);
+	return index != NULL ? &sbfd->syms.data[*index] : NULL;
 }
 
 struct superbfd *fetch_superbfd(bfd *abfd)
@@ -66,17 +323,61 @@ struct superbfd *fetch_superbfd(bfd *abfd)
 	if (abfd->usrdata != NULL)
 		return abfd->usrdata;
 
-	struct superbfd *sbfd = malloc(sizeof(*sbfd));
-	assert(sbfd != NULL);
+	struct superbfd *sbfd = arena_alloc(sizeof(*sbfd));
 
 	abfd->usrdata = sbfd;
 	sbfd->abfd = abfd;
 	get_syms(abfd, &sbfd->syms);
+	init_sym_index(sbfd);
 	vec_init(&sbfd->new_syms);
 	sbfd->new_supersects = NULL;
 	return sbfd;
 }
 
+static int compare_addr_relocs(const void *va, const void *vb)
+{
+	const struct addr_reloc *a = va, *b = vb;
+	if (a->address != b->address)
+		return a->address < b->address ? -1 : 1;
+	/* keep ss->relocs order among relocations at the same address */
+	if (a->index != b->index)
+		return a->index < b->index ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Build the address-sorted index that find_reloc searches.  Where
+ * several relocations share an address, the last one in ss->relocs
+ * wins.
+ */
+static void init_reloc_index(struct supersect *ss)
+{
+	struct addr_reloc_vec *index = &ss->reloc_index;
+	vec_init(index);
+	vec_resize(index, ss->relocs.size);
+
+	bool sorted = true;
+	size_t i;
+	for (i = 0; i < ss->relocs.size; i++) {
+		index->data[i].address = ss->relocs.data[i]->address;
+		index->data[i].reloc = ss->relocs.data[i];
+		index->data[i].index = i;
+		if (i > 0 && index->data[i - 1].address > index->data[i].address)
+			sorted = false;
+	}
+	if (!sorted)
+		qsort(index->data, index->size, sizeof(*index->data),
+		      compare_addr_relocs);
+
+	size_t n = 0;
+	for (i = 0; i < index->size; i++) {
+		if (n > 0 && index->data[n - 1].address == index->data[i].address)
+			n--;
+		index->data[n++] = index->data[i];
+	}
+	index->size = n;
+}
+
 struct supersect *fetch_supersect(struct superbfd *sbfd, asection *sect)
 {
 	assert(sect != NULL);
@@ -84,8 +385,7 @@ struct supersect *fetch_supersect(struct superbfd *sbfd, asection *sect)
 	if (sect->userdata != NULL)
 		return sect->userdata;
 
-	struct supersect *new = malloc(sizeof(*new));
-	assert(new != NULL);
+	struct supersect *new = arena_alloc(sizeof(*new));
 
 	sect->userdata = new;
 	new->parent = sbfd;
@@ -111,27 +411,21 @@ struct supersect *fetch_supersect(struct superbfd *sbfd, asection *sect)
 	vec_init(&new->new_relocs);
 
 	vec_init(&new->syms);
+	struct asymbolp_vec *sect_syms = section_syms(sbfd, sect);
 	asymbol **symp;
-	for (symp = sbfd->syms.data; symp < sbfd->syms.data + sbfd->syms.size;
+	for (symp = sect_syms->data; symp < sect_syms->data + sect_syms->size;
 	     symp++) {
 		asymbol *sym = *symp;
-		if (sym->section == sect && (sym->flags & BSF_SECTION_SYM) == 0)
+		if ((sym->flags & BSF_SECTION_SYM) == 0)
 			*vec_grow(&new->syms, 1) = sym;
 	}
 
 	vec_init(&new->spans);
+	vec_init(&new->span_index);
+	new->spans_overlap = false;
 
-	arelentp_hash_init(&new->reloc_hash);
-	arelent **relocp;
-	for (relocp = new->relocs.data;
-	     relocp < new->relocs.data + new->relocs.size; relocp++) {
-		arelent *reloc = *relocp;
-		char *key = strprintf("%lx", (unsigned long)reloc->address);
-		arelent **hash_relocp = arelentp_hash_lookup(&new->reloc_hash,
-							     key, TRUE);
-		free(key);
-		*hash_relocp = reloc;
-	}
+	init_reloc_index(new);
+	vec_init(&new->span_relocs);
 
 	return new;
 }
@@ -144,7 +438,7 @@ struct supersect *new_supersect(struct superbfd *sbfd, const char *name)
 			return ss;
 	}
 
-	struct supersect *new = malloc(sizeof(*new));
+	struct supersect *new = arena_alloc(sizeof(*new));
 	new->parent = sbfd;
 	new->name = name;
 	new->next = sbfd->new_supersects;
@@ -157,6 +451,11 @@ struct supersect *new_supersect(struct superbfd *sbfd, const char *name)
 	new->entsize = 0;
 	vec_init(&new->relocs);
 	vec_init(&new->new_relocs);
+	vec_init(&new->reloc_index);
+	vec_init(&new->span_relocs);
+	vec_init(&new->spans);
+	vec_init(&new->span_index);
+	new->spans_overlap = false;
 
 	new->type = SS_TYPE_KSPLICE;
 	return new;
@@ -190,8 +489,7 @@ static void mod_relocs(struct arelentp_vec *dest_relocs,
 	for (relocp = src_relocs->data;
 	     relocp < src_relocs->data + src_relocs->size; relocp++) {
 		if ((*relocp)->address >= start && (*relocp)->address < end) {
-			arelent *reloc = malloc(sizeof(*reloc));
-			assert(reloc != NULL);
+			arelent *reloc = arena_alloc(sizeof(*reloc));
 			*reloc = **relocp;
 			reloc->address += mod;
 			*vec_grow(dest_relocs, 1) = reloc;
@@ -267,10 +565,18 @@ bfd_vma reloc_offset(struct supersect *ss, arelent *reloc)
 arelent *find_reloc(struct supersect *ss, const void *addr)
 {
 	bfd_vma address = addr_offset(ss, addr);
-	char *key = strprintf("%lx", (unsigned long)address);
-	arelent **relocp = arelentp_hash_lookup(&ss->reloc_hash, key, FALSE);
-	free(key);
-	return relocp != NULL ? *relocp : NULL;
+	const struct addr_reloc *index = ss->reloc_index.data;
+	size_t lo = 0, hi = ss->reloc_index.size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index[mid].address < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < ss->reloc_index.size && index[lo].address == address)
+		return index[lo].reloc;
+	return NULL;
 }
 
 bfd_vma read_reloc(struct supersect *ss, const void *addr, size_t size,
@@ -316,3 +622,71 @@ const char *read_string(struct supersect *ss, const char *const *addr)
 {
 	return read_pointer(ss, (void *const *)addr, NULL);
 }
+
+/*
+ * The number of threads parallel_for (or processes, for callers that
+ * need libbfd) may use: KSPLICE_THREADS, where 0 means one per online
+ * CPU, or 1 if it is unset.
+ */
+long ksplice_threads(void)
+{
+	static long threads = -1;
+	if (threads >= 0)
+		return threads;
+	const char *str = getenv("KSPLICE_THREADS");
+	threads = str != NULL ? atol(str) : 1;
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	return threads;
+}
+
+struct parallel_job {
+	size_t n;
+	size_t next;
+	void (*fn)(size_t i, void *arg);
+	void *arg;
+};
+
+static void *parallel_worker(void *jobarg)
+{
+	struct parallel_job *job = jobarg;
+	size_t i;
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n)
+		job->fn(i, job->arg);
+	return NULL;
+}
+
+/*
+ * Call fn(i, arg) for each i in [0, n), spread over up to
+ * ksplice_threads() threads.  The calls may run in any order and at the
+ * same time, so fn must only write state that belongs to index i.  From
+ * libbfd, fn may only use pure accessors such as bfd_get_reloc_size()
+ * and bfd_get(); anything that touches a bfd_hash, interns strings or
+ * reads section contents is not thread-safe.
+ */
+void parallel_for(size_t n, void (*fn)(size_t i, void *arg), void *arg)
+{
+	struct parallel_job job = { n, 0, fn, arg };
+	long nthreads = ksplice_threads();
+	if ((size_t)nthreads > n)
+		nthreads = n;
+
+	pthread_t *threads = NULL;
+	long started = 0;
+	if (nthreads > 1) {
+		threads = malloc((nthreads - 1) * sizeof(*threads));
+		assert(threads != NULL);
+		for (; started < nthreads - 1; started++) {
+			if (pthread_create(&threads[started], NULL,
+					   parallel_worker, &job) != 0)
+				break;
+		}
+	}
+	parallel_worker(&job);
+	long t;
+	for (t = 0; t < started; t++)
+		assert(pthread_join(threads[t], NULL) == 0);
+	free(threads);
+}
@@ -36,11 +36,29 @@
 		vec_init(_srcvec);			\
 	} while (0)
 
+/*
+ * A bump allocator for the object graphs the tools build, which are
+ * never freed individually.  arena_free only gives memory back if it was
+ * the calling thread's latest allocation or a large allocation;
+ * everything else is reclaimed all at once by arena_release.
+ */
+struct arena_mark {
+	unsigned long seq;
+	struct arena_chunk *current;
+	size_t used;
+};
+
+void *arena_alloc(size_t size);
+void *arena_realloc(void *ptr, size_t old_size, size_t new_size);
+void arena_free(void *ptr, size_t size);
+void arena_mark(struct arena_mark *mark);
+void arena_release(const struct arena_mark *mark);
+
 /* void vec_free(struct vectype *vec); */
-#define vec_free(vec) do {			\
-		typeof(vec) _vec1 = (vec);	\
-		free(_vec1->data);		\
-		vec_init(_vec1);		\
+#define vec_free(vec) do {						\
+		typeof(vec) _vec1 = (vec);				\
+		arena_free(_vec1->data, _vec1->mem_size);		\
+		vec_init(_vec1);					\
 	} while (0)
 
 void vec_do_reserve(void **data, size_t *mem_size, size_t newsize);
@@ -71,6 +89,7 @@ DECLARE_VEC_TYPE(void, void_vec);
 DECLARE_VEC_TYPE(arelent *, arelentp_vec);
 DECLARE_VEC_TYPE(asymbol *, asymbolp_vec);
 DECLARE_VEC_TYPE(asymbol **, asymbolpp_vec);
+DECLARE_VEC_TYPE(unsigned long, ulong_vec);
 
 #define DECLARE_HASH_TYPE(elt_t, hashtype,				\
 			  hashtype_init, hashtype_free,			\
@@ -158,16 +177,146 @@ DECLARE_VEC_TYPE(asymbol **, asymbolpp_vec);
 			    elt_construct);
 
 
+/*
+ * Hash tables keyed by a (pointer, offset) pair, such as a supersect and
+ * an offset within it.  Open addressing with linear probing; a lookup
+ * that creates an entry may move every entry in the table, so it
+ * invalidates pointers returned by earlier lookups.
+ */
+#define DECLARE_ADDR_HASH_TYPE(elt_t, hashtype,			\
+			       hashtype_init, hashtype_free,		\
+			       hashtype_lookup)				\
+	struct hashtype##_entry {					\
+		const void *base;					\
+		bfd_vma offset;						\
+		bool used;						\
+		typeof(elt_t) val;					\
+	};								\
+									\
+	struct hashtype {						\
+		struct hashtype##_entry *entries;			\
+		size_t size;						\
+		size_t count;						\
+	};								\
+									\
+	void hashtype_init(struct hashtype *table);			\
+	void hashtype_free(struct hashtype *table);			\
+	typeof(elt_t) *hashtype_lookup(struct hashtype *table,		\
+				       const void *base,		\
+				       bfd_vma offset,			\
+				       bfd_boolean create)
+
+static inline size_t addr_hash(const void *base, bfd_vma offset)
+{
+	unsigned long h = (unsigned long)base ^ (offset * 0x9e3779b9UL);
+	h ^= h >> 16;
+	h *= 0x85ebca6bUL;
+	h ^= h >> 13;
+	return h;
+}
+
+#define IMPLEMENT_ADDR_HASH_TYPE(elt_t, hashtype,			\
+				 hashtype_init, hashtype_free,		\
+				 hashtype_lookup,			\
+				 elt_construct)				\
+									\
+	void hashtype_init(struct hashtype *table)			\
+	{								\
+		table->entries = NULL;					\
+		table->size = 0;					\
+		table->count = 0;					\
+	}								\
+									\
+	void hashtype_free(struct hashtype *table)			\
+	{								\
+		free(table->entries);					\
+		hashtype_init(table);					\
+	}								\
+									\
+	static struct hashtype##_entry *hashtype##_probe(		\
+	    struct hashtype *table, const void *base, bfd_vma offset)	\
+	{								\
+		size_t mask = table->size - 1;				\
+		size_t i = addr_hash(base, offset) & mask;		\
+		while (table->entries[i].used &&			\
+		       (table->entries[i].base != base ||		\
+			table->entries[i].offset != offset))		\
+			i = (i + 1) & mask;				\
+		return &table->entries[i];				\
+	}								\
+									\
+	static void hashtype##_grow(struct hashtype *table)		\
+	{								\
+		struct hashtype##_entry *old = table->entries;		\
+		size_t old_size = table->size;				\
+		table->size = old_size == 0 ? 64 : old_size * 2;	\
+		table->entries = calloc(table->size,			\
+					sizeof(*table->entries));	\
+		assert(table->entries != NULL);				\
+		size_t i;						\
+		for (i = 0; i < old_size; i++) {			\
+			if (old[i].used)				\
+				*hashtype##_probe(table, old[i].base,	\
+						  old[i].offset) = old[i]; \
+		}							\
+		free(old);						\
+	}								\
+									\
+	typeof(elt_t) *hashtype_lookup(struct hashtype *table,		\
+				       const void *base,		\
+				       bfd_vma offset,			\
+				       bfd_boolean create)		\
+	{								\
+		struct hashtype##_entry *e;				\
+		if (table->size != 0) {					\
+			e = hashtype##_probe(table, base, offset);	\
+			if (e->used)					\
+				return &e->val;				\
+		}							\
+		if (!create)						\
+			return NULL;					\
+		if ((table->count + 1) * 2 > table->size)		\
+			hashtype##_grow(table);				\
+		e = hashtype##_probe(table, base, offset);		\
+		e->base = base;						\
+		e->offset = offset;					\
+		e->used = true;						\
+		table->count++;						\
+		elt_construct(&e->val);					\
+		return &e->val;						\
+	}								\
+									\
+	struct eat_trailing_semicolon
+
+#define DEFINE_ADDR_HASH_TYPE(elt_t, hashtype,				\
+			      hashtype_init, hashtype_free,		\
+			      hashtype_lookup,				\
+			      elt_construct)				\
+	DECLARE_ADDR_HASH_TYPE(elt_t, hashtype, hashtype_init,		\
+			       hashtype_free, hashtype_lookup);		\
+	IMPLEMENT_ADDR_HASH_TYPE(elt_t, hashtype, hashtype_init,	\
+				 hashtype_free, hashtype_lookup,	\
+				 elt_construct);
+
 #ifndef bfd_get_section_size
 #define bfd_get_section_size(x) ((x)->_cooked_size)
 #endif
 
-DECLARE_HASH_TYPE(arelent *, arelentp_hash, arelentp_hash_init,
-		  arelentp_hash_free, arelentp_hash_lookup);
-DECLARE_HASH_TYPE(asymbol **, asymbolpp_hash, asymbolpp_hash_init,
-		  asymbolpp_hash_free, asymbolpp_hash_lookup);
+DECLARE_ADDR_HASH_TYPE(asymbol **, asymbolpp_addr_hash,
+		       asymbolpp_addr_hash_init, asymbolpp_addr_hash_free,
+		       asymbolpp_addr_hash_lookup);
 DECLARE_HASH_TYPE(const char *, string_hash, string_hash_init,
 		  string_hash_free, string_hash_lookup);
+DECLARE_ADDR_HASH_TYPE(const char *, string_addr_hash, string_addr_hash_init,
+		       string_addr_hash_free, string_addr_hash_lookup);
+DECLARE_HASH_TYPE(struct asymbolp_vec, asymbolp_vec_hash,
+		  asymbolp_vec_hash_init, asymbolp_vec_hash_free,
+		  asymbolp_vec_hash_lookup);
+DECLARE_ADDR_HASH_TYPE(struct asymbolp_vec, asymbolp_vec_addr_hash,
+		       asymbolp_vec_addr_hash_init, asymbolp_vec_addr_hash_free,
+		       asymbolp_vec_addr_hash_lookup);
+DECLARE_ADDR_HASH_TYPE(unsigned long, ulong_addr_hash, ulong_addr_hash_init,
+		       ulong_addr_hash_free, ulong_addr_hash_lookup);
 
 struct label_map {
 	asymbol *csym;
@@ -178,6 +327,9 @@ struct label_map {
 DECLARE_VEC_TYPE(struct label_map, label_map_vec);
 DECLARE_HASH_TYPE(struct label_map *, label_mapp_hash, label_mapp_hash_init,
 		  label_mapp_hash_free, label_mapp_hash_lookup);
+DECLARE_ADDR_HASH_TYPE(struct label_map *, label_mapp_addr_hash,
+		       label_mapp_addr_hash_init, label_mapp_addr_hash_free,
+		       label_mapp_addr_hash_lookup);
 
 struct entry_point {
 	const char *label;
@@ -205,18 +357,42 @@ struct span {
 	struct entry_point_vec entry_points;
 	struct entry_point_vec pre_entry_points;
 	bfd_size_type shift;
+	/* [first_reloc, last_reloc) indexes the span's relocations in
+	   ss->span_relocs; see init_span_relocs */
+	size_t first_reloc;
+	size_t last_reloc;
+	/* summaries for compare_spans; see init_span_hash */
+	bool hashed;
+	unsigned long content_hash;
+	unsigned long reloc_hash;
+	struct ulong_vec reloc_mask;
+	/* nonrelocs_equal(nonrelocs_checked, span), if precomputed */
+	struct span *nonrelocs_checked;
+	bool nonrelocs_same;
 };
 DECLARE_VEC_TYPE(struct span, span_vec);
 
+struct addr_reloc {
+	bfd_vma address;
+	arelent *reloc;
+	size_t index;	/* position in ss->relocs */
+};
+DECLARE_VEC_TYPE(struct addr_reloc, addr_reloc_vec);
+
 struct superbfd {
 	bfd *abfd;
 	struct asymbolp_vec syms;
 	struct supersect *new_supersects;
 	struct label_map_vec maps;
-	struct label_mapp_hash maps_hash;
+	struct label_mapp_addr_hash maps_hash;
 	struct asymbolpp_vec new_syms;
-	struct asymbolpp_hash csyms;
-	struct string_hash callers;
+	struct asymbolpp_addr_hash csyms;
+	struct string_addr_hash callers;
+	struct asymbolp_vec_hash syms_by_name;
+	/* syms bucketed by section, in symbol table order */
+	struct asymbolp_vec_addr_hash syms_by_section;
+	/* index of each symbol in syms */
+	struct ulong_addr_hash sym_index;
 };
 
 enum supersect_type {
@@ -238,7 +414,11 @@ struct supersect {
 	struct supersect *next;
 	struct asymbolp_vec syms;
 	struct span_vec spans;
-	struct arelentp_hash reloc_hash;
+	struct ulong_vec span_index;
+	bool spans_overlap;
+	struct addr_reloc_vec reloc_index;
+	/* relocs sorted by address, leaving relocs itself in bfd order */
+	struct arelentp_vec span_relocs;
 	asymbol *symbol;
 	bool keep;
 	enum supersect_type type;
@@ -247,6 +427,8 @@ struct supersect {
 };
 
 struct superbfd *fetch_superbfd(bfd *abfd);
+struct asymbolp_vec *section_syms(struct superbfd *sbfd, asection *sect);
+asymbol **fetch_symbolp(struct superbfd *sbfd, asymbol *sym);
 struct supersect *fetch_supersect(struct superbfd *sbfd, asection *sect);
 struct supersect *new_supersect(struct superbfd *sbfd, const char *name);
 void supersect_move(struct supersect *dest_ss, struct supersect *src_ss);
@@ -275,13 +457,21 @@ const void *read_pointer(struct supersect *ss, void *const *addr,
 			 struct supersect **ssp);
 const char *read_string(struct supersect *ss, const char *const *addr);
 
+long ksplice_threads(void);
+void parallel_for(size_t n, void (*fn)(size_t i, void *arg), void *arg);
+
 #define read_num(ss, addr) ((typeof(*(addr))) \
 			    read_reloc(ss, addr, sizeof(*(addr)), NULL))
 
 static inline char *vstrprintf(const char *fmt, va_list ap)
 {
-	char *str;
-	assert(vasprintf(&str, fmt, ap) >= 0);
+	va_list aq;
+	va_copy(aq, ap);
+	int len = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	assert(len >= 0);
+	char *str = arena_alloc(len + 1);
+	vsnprintf(str, len + 1, fmt, ap);
 	return str;
 }
 
@@ -294,3 +484,7 @@ strprintf(const char *fmt, ...)
 	va_end(ap);
 	return str;
 }
+
+const char *intern(const char *str);
+const char *internf(const char *fmt, ...)
+    __attribute__((format (printf, 1, 2)));
@@ -26,6 +26,11 @@
  * This mode prepares the object file to be installed as a ksplice update.  The
  * kid argument is the ksplice id string for the ksplice update being built.
  *
+ * - keep-code: "objmanip <post.o> <out.o> keep-code <pre.o> <kid> <old.o>"
+ *
+ * This mode does keep-new-code and, in a child process sharing the parsed
+ * pre.o, "objmanip <pre.o> <old.o> keep-old-code".
+ *
  * - keep-old-code: "objmanip <pre.o> <out.o> keep-old-code"
  *
  * This mode prepares the object file to be used for run-pre matching.  This
@@ -42,6 +47,15 @@
  *
  * In this mode, any ELF relocations to undefined symbols are replaced with
  * ksplice relocations.
+ *
+ * - batch mode: "objmanip --batch [<manifest>]"
+ *
+ * This mode reads one "<in.o> <out.o> <mode> [args...]" operation per line
+ * from the manifest, or from standard input if none is given, and runs them
+ * all in one process so that System.map and offsets.o are only loaded once.
+ * Arguments are separated by blanks; a backslash makes the character after
+ * it, such as a blank in a file name or another backslash, part of the
+ * argument.  Lines cannot otherwise contain newlines.
  */
 
 /* Always define KSPLICE_STANDALONE, even if you're using integrated Ksplice.
@@ -58,6 +72,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #define KSPLICE_SYMBOL_STR "KSPLICE_SYMBOL_"
 
@@ -67,7 +88,12 @@ DEFINE_HASH_TYPE(asymbol *, symbol_hash, symbol_hash_init, symbol_hash_free,
 
 DECLARE_VEC_TYPE(const char *, str_vec);
 
-DECLARE_VEC_TYPE(unsigned long, ulong_vec);
+DECLARE_VEC_TYPE(struct span *, spanp_vec);
+DEFINE_ADDR_HASH_TYPE(struct spanp_vec, spanp_vec_addr_hash,
+		      spanp_vec_addr_hash_init, spanp_vec_addr_hash_free,
+		      spanp_vec_addr_hash_lookup, vec_init);
+
+DECLARE_VEC_TYPE(struct supersect *, supersect_vec);
 
 #define bool_init(b) *(b) = false
 DEFINE_HASH_TYPE(bool, bool_hash, bool_hash_init, bool_hash_free,
@@ -77,7 +103,7 @@ DEFINE_HASH_TYPE(bool, bool_hash, bool_hash_init, bool_hash_free,
 DEFINE_HASH_TYPE(unsigned long, ulong_hash, ulong_hash_init,
 		 ulong_hash_free, ulong_hash_lookup, ulong_init);
 
-void do_keep_new_code(struct superbfd *isbfd, const char *pre);
+void do_keep_new_code(struct superbfd *isbfd, struct superbfd *presbfd);
 void do_keep_old_code(struct superbfd *isbfd);
 void do_finalize(struct superbfd *isbfd);
 void do_rmsyms(struct superbfd *isbfd);
@@ -88,6 +114,9 @@ bfd_vma non_dst_mask(struct supersect *ss, arelent *reloc);
 bool all_relocs_equal(struct span *old_span, struct span *new_span);
 static bool part_of_reloc(struct supersect *ss, unsigned long addr);
 static bool nonrelocs_equal(struct span *old_span, struct span *new_span);
+static void init_span_hash(struct span *span);
+static void precompare_matched_spans(struct superbfd *newsbfd);
+static bool reloc_masks_equal(struct span *old_span, struct span *new_span);
 static void handle_section_symbol_renames(struct superbfd *oldsbfd,
 					  struct superbfd *newsbfd);
 static void compute_entry_points(struct superbfd *sbfd);
@@ -106,6 +135,8 @@ struct span *reloc_target_span(struct supersect *ss, arelent *reloc);
 static struct span *span_offset_target_span(struct span *span, int offset);
 static bfd_vma reloc_target_offset(struct supersect *ss, arelent *reloc);
 struct span *find_span(struct supersect *ss, bfd_size_type address);
+static void update_span_index(struct supersect *ss);
+static struct span *lookup_span_index(struct supersect *ss, bfd_vma address);
 void remove_unkept_spans(struct superbfd *sbfd);
 void compute_span_shifts(struct superbfd *sbfd);
 static struct span *new_span(struct supersect *ss, bfd_vma start, bfd_vma size);
@@ -141,6 +172,12 @@ static void write_ksplice_table_reloc(struct supersect *ss,
 				      unsigned long address,
 				      const char *label,
 				      enum ksplice_reloc_howto_type type);
+static void sort_new_relocs(struct superbfd *sbfd);
+static void sort_ksplice_sections(struct superbfd *sbfd);
+static void sort_ksplice_system_map(struct superbfd *sbfd);
+static void write_ksplice_symbol_hash(struct superbfd *sbfd);
+static void write_ksplice_reloc_table(struct superbfd *sbfd);
+static void discard_section(struct supersect *ss);
 void load_ksplice_symbol_offsets(struct superbfd *sbfd);
 void write_canary(struct supersect *ss, int offset, bfd_size_type size,
 		  bfd_vma dst_mask);
@@ -164,12 +201,14 @@ void setup_section(bfd *ibfd, asection *isection, void *obfdarg);
 static void setup_new_section(bfd *obfd, struct supersect *ss);
 static void write_section(bfd *obfd, asection *osection, void *arg);
 static void delete_obsolete_relocs(struct supersect *ss);
+static int compare_reloc_addresses(const void *aptr, const void *bptr);
 void mark_symbols_used_in_relocations(bfd *abfd, asection *isection,
 				      void *ignored);
 static void ss_mark_symbols_used_in_relocations(struct supersect *ss);
 void filter_symbols(bfd *ibfd, bfd *obfd, struct asymbolp_vec *osyms,
 		    struct asymbolp_vec *isyms);
 static bool deleted_table_section_symbol(bfd *abfd, asymbol *sym);
+struct supersect *find_section(struct superbfd *sbfd, const char *name);
 struct supersect *__attribute((format(printf, 2, 3)))
 make_section(struct superbfd *sbfd, const char *fmt, ...);
 void __attribute__((format(printf, 3, 4)))
@@ -198,9 +237,20 @@ static struct span *get_crc_span(struct span *span,
 static void foreach_span_pair(struct superbfd *oldsbfd,
 			      struct superbfd *newsbfd,
 			      void (*fn)(struct span *old_span,
-					 struct span *new_span));
+					 struct span *new_span),
+			      const char *(*key)(struct span *span));
+static void match_table_span_pairs(struct superbfd *oldsbfd,
+				   struct superbfd *newsbfd);
+static void match_other_span_pairs(struct superbfd *oldsbfd,
+				   struct superbfd *newsbfd);
 static void match_spans_by_label(struct span *old_span, struct span *new_span);
 static void match_string_spans(struct span *old_span, struct span *new_span);
+static const char *span_label_key(struct span *span);
+static const char *string_span_key(struct span *span);
+static void init_span_worklist(struct superbfd *sbfd);
+static void free_span_worklist(void);
+static void add_span_dependency(struct span *target, struct span *span);
+static void span_changed(struct span *span);
 static void mark_new_spans(struct superbfd *sbfd);
 static void handle_deleted_spans(struct superbfd *oldsbfd,
 				 struct superbfd *newsbfd);
@@ -213,6 +263,9 @@ static void handle_nonzero_offset_relocs(struct supersect *ss);
 static void keep_span(struct span *span);
 
 static void init_objmanip_superbfd(struct superbfd *sbfd);
+static void init_syms_by_name(struct superbfd *sbfd);
+static void init_span_relocs(struct superbfd *sbfd);
+static arelent **span_relocs(struct supersect *ss);
 static const char *label_lookup(struct superbfd *sbfd, asymbol *sym);
 static void label_map_set(struct superbfd *sbfd, const char *oldlabel,
 			  const char *label);
@@ -225,7 +278,7 @@ static void init_callers(struct superbfd *sbfd);
 static asymbol *canonical_symbol(struct superbfd *sbfd, asymbol *sym);
 static asymbol **canonical_symbolp(struct superbfd *sbfd, asymbol *sym);
 static char *static_local_symbol(struct superbfd *sbfd, asymbol *sym);
-static char *symbol_label(struct superbfd *sbfd, asymbol *sym);
+static const char *symbol_label(struct superbfd *sbfd, asymbol *sym);
 
 int verbose = 0;
 #define debug_(sbfd, level, fmt, ...)					\
@@ -245,6 +298,7 @@ int verbose = 0;
 struct str_vec delsects;
 struct asymbolp_vec extract_syms;
 bool changed;
+unsigned long deep_compares, deep_compares_avoided;
 
 struct ksplice_config *config;
 
@@ -255,19 +309,254 @@ struct superbfd *offsets_sbfd = NULL;
 
 #define mode(str) strstarts(modestr, str)
 
+/*
+ * If KSPLICE_PROFILE names a file, each operation appends one JSON line
+ * to it giving the wall and CPU time of each phase along with the size
+ * of the input, for ksplice-create to aggregate.  maxrss is the peak
+ * resident set size of the process so far, in kilobytes, so in a batch
+ * it also covers the operations before this one.
+ */
+struct profile_phase {
+	const char *name;
+	double wall, cpu;
+};
+DECLARE_VEC_TYPE(struct profile_phase, profile_phase_vec);
+
+static struct {
+	const char *path;
+	struct timespec start_wall, start_cpu, wall, cpu;
+	struct profile_phase_vec phases;
+	unsigned long sections, spans, relocs, iterations;
+} profile;
+
+static double profile_elapsed(clockid_t clock, const struct timespec *since,
+			      struct timespec *now)
+{
+	assert(clock_gettime(clock, now) == 0);
+	return (now->tv_sec - since->tv_sec) +
+	    (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void profile_start(void)
+{
+	profile.path = getenv("KSPLICE_PROFILE");
+	if (profile.path != NULL && profile.path[0] == '\0')
+		profile.path = NULL;
+	if (profile.path == NULL)
+		return;
+	vec_init(&profile.phases);
+	profile.sections = profile.spans = profile.relocs = 0;
+	profile.iterations = 0;
+	assert(clock_gettime(CLOCK_MONOTONIC, &profile.start_wall) == 0);
+	assert(clock_gettime(CLOCK_PROCESS_CPUTIME_ID,
+			     &profile.start_cpu) == 0);
+	profile.wall = profile.start_wall;
+	profile.cpu = profile.start_cpu;
+}
+
+/* Charge the time since the last phase ended to the named phase */
+static void profile_phase(const char *name)
+{
+	if (profile.path == NULL)
+		return;
+	struct profile_phase *phase = vec_grow(&profile.phases, 1);
+	phase->name = name;
+	phase->wall = profile_elapsed(CLOCK_MONOTONIC, &profile.wall,
+				      &profile.wall);
+	phase->cpu = profile_elapsed(CLOCK_PROCESS_CPUTIME_ID, &profile.cpu,
+				     &profile.cpu);
+}
+
+static void profile_count(struct superbfd *sbfd)
+{
+	if (profile.path == NULL)
+		return;
+	asection *sect;
+	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
+		struct supersect *ss = fetch_supersect(sbfd, sect);
+		profile.sections++;
+		profile.spans += ss->spans.size;
+		profile.relocs += ss->relocs.size;
+	}
+}
+
+static void print_json_string(FILE *fp, const char *str)
+{
+	putc('"', fp);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			putc(*str, fp);
+	}
+	putc('"', fp);
+}
+
+static void profile_report(const char *input)
+{
+	if (profile.path == NULL)
+		return;
+	struct timespec now;
+	struct rusage usage;
+	assert(getrusage(RUSAGE_SELF, &usage) == 0);
+	char *buf;
+	size_t size;
+	FILE *fp = open_memstream(&buf, &size);
+	assert(fp != NULL);
+
+	fprintf(fp, "{\"input\":");
+	print_json_string(fp, input);
+	fprintf(fp, ",\"mode\":");
+	print_json_string(fp, modestr);
+	fprintf(fp, ",\"wall\":%.6f,\"cpu\":%.6f,\"phases\":[",
+		profile_elapsed(CLOCK_MONOTONIC, &profile.start_wall, &now),
+		profile_elapsed(CLOCK_PROCESS_CPUTIME_ID, &profile.start_cpu,
+				&now));
+	struct profile_phase *phase;
+	for (phase = profile.phases.data;
+	     phase < profile.phases.data + profile.phases.size; phase++)
+		fprintf(fp, "%s{\"name\":\"%s\",\"wall\":%.6f,\"cpu\":%.6f}",
+			phase == profile.phases.data ? "" : ",", phase->name,
+			phase->wall, phase->cpu);
+	fprintf(fp, "],\"sections\":%lu,\"spans\":%lu,\"relocs\":%lu,"
+		"\"iterations\":%lu,\"deep_compares\":%lu,"
+		"\"deep_compares_avoided\":%lu,\"maxrss\":%ld}\n",
+		profile.sections, profile.spans, profile.relocs,
+		profile.iterations, deep_compares, deep_compares_avoided,
+		usage.ru_maxrss);
+	assert(fclose(fp) == 0);
+
+	/* A single O_APPEND write keeps lines from parallel runs intact */
+	int fd = open(profile.path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+	assert(fd >= 0);
+	assert(write(fd, buf, size) == size);
+	close(fd);
+	free(buf);
+	vec_free(&profile.phases);
+}
+
 DECLARE_VEC_TYPE(unsigned long, addr_vec);
 DEFINE_HASH_TYPE(struct addr_vec, addr_vec_hash,
 		 addr_vec_hash_init, addr_vec_hash_free, addr_vec_hash_lookup,
 		 vec_init);
 struct addr_vec_hash system_map;
+DEFINE_ADDR_HASH_TYPE(bool, bool_addr_hash, bool_addr_hash_init,
+		      bool_addr_hash_free, bool_addr_hash_lookup, bool_init);
 
 struct bool_hash system_map_written;
 struct ulong_hash ksplice_symbol_offset;
 struct ulong_hash ksplice_howto_offset;
 struct ulong_hash ksplice_string_offset;
 
+/*
+ * The System.map index that ksplice-obj.pl system_map_index writes:
+ * a header, the symbol names sorted by strcmp, the addresses for each
+ * name in System.map order as native unsigned longs, and a string pool.
+ */
+#define SYSTEM_MAP_INDEX_MAGIC "KSMAPIDX"
+#define SYSTEM_MAP_INDEX_VERSION 1
+
+struct system_map_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t long_size;
+	uint32_t nr_names;
+	uint32_t nr_addrs;
+};
+
+struct system_map_index_name {
+	uint32_t name_off;
+	uint32_t addrs_off;
+	uint32_t nr_addrs;
+};
+
+static struct {
+	const void *map;
+	size_t size;
+	const struct system_map_index_name *names;
+	uint32_t nr_names;
+	const unsigned long *addrs;
+	const char *strings;
+} system_map_index;
+
+static bool map_system_map_index(void)
+{
+	const char *path = getenv("KSPLICE_SYSTEM_MAP_INDEX");
+	if (path == NULL)
+		return false;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 &&
+	    st.st_size >= sizeof(struct system_map_index_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const struct system_map_index_header *hdr = map;
+	size_t names_size = (size_t)hdr->nr_names *
+	    sizeof(struct system_map_index_name);
+	size_t addrs_start = align(sizeof(*hdr) + names_size,
+				   sizeof(unsigned long));
+	size_t strings_start = addrs_start +
+	    (size_t)hdr->nr_addrs * sizeof(unsigned long);
+	if (memcmp(hdr->magic, SYSTEM_MAP_INDEX_MAGIC,
+		   sizeof(hdr->magic)) != 0 ||
+	    hdr->version != SYSTEM_MAP_INDEX_VERSION ||
+	    hdr->long_size != sizeof(unsigned long) ||
+	    strings_start > st.st_size) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	system_map_index.map = map;
+	system_map_index.size = st.st_size;
+	system_map_index.names = map + sizeof(*hdr);
+	system_map_index.nr_names = hdr->nr_names;
+	system_map_index.addrs = map + addrs_start;
+	system_map_index.strings = map + strings_start;
+	return true;
+}
+
+static int compare_system_map_index_name(const void *key, const void *elt)
+{
+	const struct system_map_index_name *name = elt;
+	return strcmp(key, system_map_index.strings + name->name_off);
+}
+
+/* The System.map addresses of name, in System.map order */
+static const unsigned long *system_map_addrs(const char *name, size_t *nr)
+{
+	if (system_map_index.map != NULL) {
+		const struct system_map_index_name *entry =
+		    bsearch(name, system_map_index.names,
+			    system_map_index.nr_names,
+			    sizeof(*system_map_index.names),
+			    compare_system_map_index_name);
+		if (entry == NULL)
+			return NULL;
+		*nr = entry->nr_addrs;
+		return system_map_index.addrs + entry->addrs_off;
+	}
+
+	struct addr_vec *map_addrs =
+	    addr_vec_hash_lookup(&system_map, name, FALSE);
+	if (map_addrs == NULL)
+		return NULL;
+	*nr = map_addrs->size;
+	return map_addrs->data;
+}
+
 void load_system_map()
 {
+	if (map_system_map_index())
+		return;
+
 	const char *config_dir = getenv("KSPLICE_CONFIG_DIR");
 	assert(config_dir);
 	FILE *fp = fopen(strprintf("%s/System.map", config_dir), "r");
@@ -309,6 +598,10 @@ void load_offsets()
 	char **matching;
 	assert(bfd_check_format_matches(offsets_bfd, bfd_object, &matching));
 	offsets_sbfd = fetch_superbfd(offsets_bfd);
+	/* Fetch everything now, so that no operation's arena holds any of it */
+	asection *sect;
+	for (sect = offsets_bfd->sections; sect != NULL; sect = sect->next)
+		fetch_supersect(offsets_sbfd, sect);
 
 	asection *config_sect = bfd_get_section_by_name(offsets_sbfd->abfd,
 							".ksplice_config");
@@ -379,40 +672,116 @@ bool unchangeable_section(struct supersect *ss)
 	return false;
 }
 
-int main(int argc, char *argv[])
+static struct superbfd *open_superbfd(const char *path)
 {
-	if (getenv("KSPLICE_VERBOSE") != NULL)
-		verbose = atoi(getenv("KSPLICE_VERBOSE"));
+	bfd *abfd = bfd_openr(path, NULL);
+	assert(abfd != NULL);
+	char **matching;
+	assert(bfd_check_format_matches(abfd, bfd_object, &matching));
+	return fetch_superbfd(abfd);
+}
 
-	bfd_init();
-	bfd *ibfd = bfd_openr(argv[1], NULL);
+static void write_object(bfd *ibfd, const char *path, const char *target)
+{
+	bfd *obfd = bfd_openw(path, target);
+	assert(obfd);
+	copy_object(ibfd, obfd);
+	assert(bfd_close(obfd));
+}
+
+/*
+ * Run keep-old-code on presbfd in a child process, writing output.
+ * Everything is read from presbfd's file before the fork, so the parent
+ * can go on to use presbfd for keep-new-code without either process
+ * touching the shared file offset again.
+ */
+static pid_t fork_keep_old_code(struct superbfd *presbfd, const char *output)
+{
+	asection *sect;
+	for (sect = presbfd->abfd->sections; sect != NULL; sect = sect->next)
+		fetch_supersect(presbfd, sect);
+
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid != 0)
+		return pid;
+
+	modestr = "keep-old-code";
+	profile_start();
+	init_objmanip_superbfd(presbfd);
+	profile_count(presbfd);
+	profile_phase("load");
+	do_keep_old_code(presbfd);
+	if (write_output)
+		write_object(presbfd->abfd, output,
+			     bfd_get_target(presbfd->abfd));
+	profile_phase("write");
+	profile_report(presbfd->abfd->filename);
+	fflush(stdout);
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Run one operation, "<input> <output> <mode> [args...]", against the
+ * System.map and offsets already loaded by main.
+ */
+static int objmanip(int argc, char *argv[])
+{
+	assert(argc >= 3);
+	struct arena_mark mark;
+	arena_mark(&mark);
+	profile_start();
+	bfd *ibfd = bfd_openr(argv[0], NULL);
 	assert(ibfd);
 
 	char **matching;
 	if (bfd_check_format_matches(ibfd, bfd_archive, &matching) &&
-	    bfd_openr_next_archived_file(ibfd, NULL) == NULL)
+	    bfd_openr_next_archived_file(ibfd, NULL) == NULL) {
+		assert(bfd_close(ibfd));
+		arena_release(&mark);
 		return 66; /* empty archive */
+	}
 	assert(bfd_check_format_matches(ibfd, bfd_object, &matching));
 
 	const char *output_target = bfd_get_target(ibfd);
 
-	load_system_map();
-	load_offsets();
-
 	bool_hash_init(&system_map_written);
 	ulong_hash_init(&ksplice_symbol_offset);
 	ulong_hash_init(&ksplice_howto_offset);
 	ulong_hash_init(&ksplice_string_offset);
+	vec_init(&extract_syms);
+	changed = false;
+	deep_compares = deep_compares_avoided = 0;
+	write_output = true;
+	finalize_target = NULL;
+	kid = NULL;
 
 	struct superbfd *isbfd = fetch_superbfd(ibfd);
 
-	modestr = argv[3];
-	if (mode("finalize"))
-		finalize_target = argv[4];
+	modestr = argv[2];
+	if (mode("finalize")) {
+		assert(argc >= 4);
+		finalize_target = argv[3];
+	}
+	struct superbfd *presbfd = NULL;
+	pid_t old_code_pid = 0;
+	if (mode("keep-code")) {
+		assert(argc >= 6);
+		presbfd = open_superbfd(argv[3]);
+		old_code_pid = fork_keep_old_code(presbfd, argv[5]);
+		modestr = "keep-new-code";
+	} else if (mode("keep-new-code")) {
+		assert(argc >= 5);
+		presbfd = open_superbfd(argv[3]);
+	}
 	init_objmanip_superbfd(isbfd);
+	profile_count(isbfd);
+	profile_phase("load");
 	if (mode("keep-new-code")) {
-		kid = argv[5];
-		do_keep_new_code(isbfd, argv[4]);
+		kid = argv[4];
+		do_keep_new_code(isbfd, presbfd);
 	} else if (mode("keep-old-code")) {
 		do_keep_old_code(isbfd);
 	} else if (mode("finalize")) {
@@ -421,48 +790,162 @@ int main(int argc, char *argv[])
 		do_rmsyms(isbfd);
 	}
 
-	if (write_output) {
-		bfd *obfd = bfd_openw(argv[2], output_target);
-		assert(obfd);
-		copy_object(ibfd, obfd);
-		assert(bfd_close(obfd));
+	if (write_output)
+		write_object(ibfd, argv[1], output_target);
+	profile_phase("write");
+
+	if (old_code_pid != 0) {
+		int status;
+		assert(waitpid(old_code_pid, &status, 0) == old_code_pid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		profile_phase("wait-old-code");
 	}
+	profile_report(argv[0]);
 
-	if (offsets_sbfd != NULL)
-		assert(bfd_close(offsets_sbfd->abfd));
+	bool_hash_free(&system_map_written);
+	ulong_hash_free(&ksplice_symbol_offset);
+	ulong_hash_free(&ksplice_howto_offset);
+	ulong_hash_free(&ksplice_string_offset);
+	vec_free(&extract_syms);
 	assert(bfd_close(ibfd));
+	arena_release(&mark);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Split a manifest line into at most max_args arguments in place,
+ * removing the backslashes that escape blanks and backslashes.
+ */
+static int split_manifest_line(char *line, char *args[], int max_args)
+{
+	char *in = line, *out = line;
+	int nargs = 0;
+	while (true) {
+		while (*in == ' ' || *in == '\t' || *in == '\n')
+			in++;
+		if (*in == '\0')
+			return nargs;
+		assert(nargs < max_args);
+		args[nargs++] = out;
+		while (*in != '\0' && *in != ' ' && *in != '\t' &&
+		       *in != '\n') {
+			if (*in == '\\' && in[1] != '\0')
+				in++;
+			*out++ = *in++;
+		}
+		if (*in != '\0')
+			in++;
+		*out++ = '\0';
+	}
+}
+
+/*
+ * Run one operation per line of the manifest (or standard input), in
+ * the same "<input> <output> <mode> [args...]" form as the command
+ * line.  An empty input archive produces no output rather than ending
+ * the batch; the caller is expected to notice the missing file.
+ */
+static int objmanip_batch(const char *manifest)
+{
+	FILE *fp = stdin;
+	if (manifest != NULL && strcmp(manifest, "-") != 0)
+		fp = fopen(manifest, "r");
+	assert(fp != NULL);
+
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, fp) != -1) {
+		char *args[8];
+		int nargs = split_manifest_line(line, args,
+						sizeof(args) / sizeof(*args));
+		if (nargs == 0 || args[0][0] == '#')
+			continue;
+		int ret = objmanip(nargs, args);
+		if (ret != EXIT_SUCCESS && ret != 66)
+			return ret;
+		fflush(stdout);
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
 	return EXIT_SUCCESS;
 }
 
-void do_keep_new_code(struct superbfd *isbfd, const char *pre)
+int main(int argc, char *argv[])
 {
-	struct bfd *prebfd = bfd_openr(pre, NULL);
-	assert(prebfd != NULL);
-	char **matching;
-	assert(bfd_check_format_matches(prebfd, bfd_object, &matching));
+	if (getenv("KSPLICE_VERBOSE") != NULL)
+		verbose = atoi(getenv("KSPLICE_VERBOSE"));
+
+	bfd_init();
+
+	bool batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+	if (!batch) {
+		assert(argc >= 4);
+		/* Check for an empty archive before loading anything */
+		bfd *ibfd = bfd_openr(argv[1], NULL);
+		assert(ibfd);
+		char **matching;
+		bool empty = bfd_check_format_matches(ibfd, bfd_archive,
+						      &matching) &&
+		    bfd_openr_next_archived_file(ibfd, NULL) == NULL;
+		assert(bfd_close(ibfd));
+		if (empty)
+			return 66;
+	}
+
+	load_system_map();
+	load_offsets();
+
+	int ret;
+	if (batch)
+		ret = objmanip_batch(argc >= 3 ? argv[2] : NULL);
+	else
+		ret = objmanip(argc - 1, argv + 1);
+
+	if (offsets_sbfd != NULL)
+		assert(bfd_close(offsets_sbfd->abfd));
+	return ret;
+}
 
-	struct superbfd *presbfd = fetch_superbfd(prebfd);
+void do_keep_new_code(struct superbfd *isbfd, struct superbfd *presbfd)
+{
 	init_objmanip_superbfd(presbfd);
+	profile_phase("load-pre");
 
 	foreach_symbol_pair(presbfd, isbfd, match_global_symbols);
 	debug1(isbfd, "Matched global\n");
-	foreach_span_pair(presbfd, isbfd, match_string_spans);
+	profile_phase("match-global");
+	foreach_span_pair(presbfd, isbfd, match_string_spans, string_span_key);
 	debug1(isbfd, "Matched string spans\n");
+	profile_phase("match-strings");
 	foreach_symbol_pair(presbfd, isbfd, match_symbol_spans);
 	debug1(isbfd, "Matched by name\n");
-	foreach_span_pair(presbfd, isbfd, match_spans_by_label);
+	profile_phase("match-by-name");
+	foreach_span_pair(presbfd, isbfd, match_spans_by_label,
+			  span_label_key);
 	debug1(isbfd, "Matched by label\n");
-	foreach_span_pair(presbfd, isbfd, match_table_spans);
+	profile_phase("match-by-label");
+	match_table_span_pairs(presbfd, isbfd);
 	debug1(isbfd, "Matched table spans\n");
-	foreach_span_pair(presbfd, isbfd, match_other_spans);
+	profile_phase("match-tables");
+	match_other_span_pairs(presbfd, isbfd);
 	debug1(isbfd, "Matched other spans\n");
+	profile_phase("match-other");
 
+	precompare_matched_spans(isbfd);
+	profile_phase("precompare");
+	init_span_worklist(isbfd);
 	do {
 		changed = false;
 		compare_matched_spans(isbfd);
 		update_nonzero_offsets(isbfd);
 		mark_new_spans(isbfd);
+		profile.iterations++;
 	} while (changed);
+	free_span_worklist();
+	profile_phase("fixpoint");
+	debug1(isbfd, "Hashes avoided %lu of %lu deep span comparisons\n",
+	       deep_compares_avoided, deep_compares);
 	vec_init(&delsects);
 
 	foreach_symbol_pair(presbfd, isbfd, check_global_symbols);
@@ -472,12 +955,10 @@ void do_keep_new_code(struct superbfd *isbfd, const char *pre)
 
 	copy_patched_entry_points(presbfd, isbfd);
 
-	assert(bfd_close(prebfd));
+	assert(bfd_close(presbfd->abfd));
+	profile_phase("reconcile");
 
-	do {
-		changed = false;
-		mark_precallable_spans(isbfd);
-	} while (changed);
+	mark_precallable_spans(isbfd);
 
 	asection *sect;
 	for (sect = isbfd->abfd->sections; sect != NULL; sect = sect->next) {
@@ -534,6 +1015,7 @@ void do_keep_new_code(struct superbfd *isbfd, const char *pre)
 	filter_table_sections(isbfd);
 
 	compute_span_shifts(isbfd);
+	profile_phase("select-spans");
 
 	for (sect = isbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(isbfd, sect);
@@ -554,8 +1036,11 @@ void do_keep_new_code(struct superbfd *isbfd, const char *pre)
 	}
 
 	write_bugline_patches(isbfd);
+	profile_phase("write-sections");
 	rm_relocs(isbfd);
+	profile_phase("rm-relocs");
 	remove_unkept_spans(isbfd);
+	profile_phase("remove-spans");
 }
 
 void do_keep_old_code(struct superbfd *isbfd)
@@ -593,13 +1078,11 @@ void do_keep_old_code(struct superbfd *isbfd)
 		}
 	}
 
-	do {
-		changed = false;
-		keep_referenced_sections(isbfd);
-	} while (changed);
+	keep_referenced_sections(isbfd);
 
 	filter_table_sections(isbfd);
 	compute_span_shifts(isbfd);
+	profile_phase("select-spans");
 
 	for (sect = isbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(isbfd, sect);
@@ -625,7 +1108,9 @@ void do_keep_old_code(struct superbfd *isbfd)
 
 	write_table_relocs(isbfd, "__bug_table", KSPLICE_HOWTO_BUG);
 	write_table_relocs(isbfd, "__ex_table", KSPLICE_HOWTO_EXTABLE);
+	profile_phase("write-sections");
 	rm_relocs(isbfd);
+	profile_phase("rm-relocs");
 	remove_unkept_spans(isbfd);
 
 	mangle_section_name(isbfd, "__markers");
@@ -636,25 +1121,32 @@ void do_keep_old_code(struct superbfd *isbfd)
 		if (ss->type == SS_TYPE_EXPORT)
 			mangle_section_name(isbfd, ss->name);
 	}
+	profile_phase("remove-spans");
 }
 
 void do_finalize(struct superbfd *isbfd)
 {
 	load_ksplice_symbol_offsets(isbfd);
+	profile_phase("load-symbol-offsets");
 	asection *sect;
 	for (sect = isbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(isbfd, sect);
-		if (ss->type == SS_TYPE_EXIT) {
-			struct span *span;
-			for (span = ss->spans.data;
-			     span < ss->spans.data + ss->spans.size; span++)
-				span->keep = false;
-			ss->keep = false;
-		}
+		if (ss->type == SS_TYPE_EXIT)
+			discard_section(ss);
 	}
 	write_date_relocs(isbfd, "<{DATE...}>", KSPLICE_HOWTO_DATE);
 	write_date_relocs(isbfd, "<{TIME}>", KSPLICE_HOWTO_TIME);
+	profile_phase("date-relocs");
 	rm_relocs(isbfd);
+	profile_phase("rm-relocs");
+	sort_new_relocs(isbfd);
+	sort_ksplice_sections(isbfd);
+	sort_ksplice_system_map(isbfd);
+	profile_phase("sort");
+	write_ksplice_symbol_hash(isbfd);
+	profile_phase("symbol-hash");
+	write_ksplice_reloc_table(isbfd);
+	profile_phase("reloc-table");
 }
 
 void do_rmsyms(struct superbfd *isbfd)
@@ -678,6 +1170,7 @@ void do_rmsyms(struct superbfd *isbfd)
 	}
 
 	rm_relocs(isbfd);
+	profile_phase("rm-relocs");
 }
 
 void match_spans(struct span *old_span, struct span *new_span)
@@ -734,6 +1227,8 @@ void unmatch_span(struct span *old_span)
 	new_span->datapatch = false;
 
 	changed = true;
+	span_changed(old_span);
+	span_changed(new_span);
 }
 
 static void match_global_symbols(struct span *old_span, asymbol *oldsym,
@@ -796,16 +1291,16 @@ static void foreach_symbol_pair(struct superbfd *oldsbfd, struct superbfd *newsb
 
 		bool found = false;
 
-		for (newsymp = newsbfd->syms.data;
-		     newsymp < newsbfd->syms.data + newsbfd->syms.size;
-		     newsymp++) {
-			asymbol *newsym = *newsymp;
-			if ((newsym->flags & BSF_DEBUGGING) != 0 ||
-			    bfd_is_const_section(newsym->section))
-				continue;
-			if (strcmp(oldsym->name, newsym->name) != 0)
-				continue;
+		static struct asymbolp_vec no_syms;
+		struct asymbolp_vec *newsyms =
+		    asymbolp_vec_hash_lookup(&newsbfd->syms_by_name,
+					     oldsym->name, FALSE);
+		if (newsyms == NULL)
+			newsyms = &no_syms;
 
+		for (newsymp = newsyms->data;
+		     newsymp < newsyms->data + newsyms->size; newsymp++) {
+			asymbol *newsym = *newsymp;
 			struct supersect *new_ss =
 			    fetch_supersect(newsbfd, newsym->section);
 			if (old_ss->type != new_ss->type &&
@@ -830,6 +1325,25 @@ static void foreach_symbol_pair(struct superbfd *oldsbfd, struct superbfd *newsb
 	}
 }
 
+/* Index the non-debugging symbols of sbfd by name, in symbol table order */
+static void init_syms_by_name(struct superbfd *sbfd)
+{
+	asymbolp_vec_hash_init(&sbfd->syms_by_name);
+
+	asymbol **symp;
+	for (symp = sbfd->syms.data; symp < sbfd->syms.data + sbfd->syms.size;
+	     symp++) {
+		asymbol *sym = *symp;
+		if ((sym->flags & BSF_DEBUGGING) != 0 ||
+		    bfd_is_const_section(sym->section))
+			continue;
+		struct asymbolp_vec *syms =
+		    asymbolp_vec_hash_lookup(&sbfd->syms_by_name, sym->name,
+					     TRUE);
+		*vec_grow(syms, 1) = sym;
+	}
+}
+
 static void match_symbol_spans(struct span *old_span, asymbol *oldsym,
 			       struct span *new_span, asymbol *newsym)
 {
@@ -850,10 +1364,15 @@ static void match_spans_by_label(struct span *old_span, struct span *new_span)
 	    (is_table_section(old_span->ss->name, true, false) &&
 	     !is_table_section(old_span->ss->name, false, false)))
 		return;
-	if (strcmp(old_span->label, new_span->label) == 0)
+	if (old_span->label == new_span->label)
 		match_spans(old_span, new_span);
 }
 
+static const char *span_label_key(struct span *span)
+{
+	return span->label;
+}
+
 static void match_string_spans(struct span *old_span, struct span *new_span)
 {
 	if (old_span->ss->type != SS_TYPE_STRING ||
@@ -864,48 +1383,393 @@ static void match_string_spans(struct span *old_span, struct span *new_span)
 		match_spans(old_span, new_span);
 }
 
+static const char *string_span_key(struct span *span)
+{
+	if (span->ss->type != SS_TYPE_STRING)
+		return NULL;
+	return span->ss->contents.data + span->start;
+}
+
+struct span_pair {
+	int old_sect;
+	struct span *old_span;
+	struct span *new_span;
+};
+DECLARE_VEC_TYPE(struct span_pair, span_pair_vec);
+DEFINE_HASH_TYPE(struct span_pair_vec, span_pair_vec_hash,
+		 span_pair_vec_hash_init, span_pair_vec_hash_free,
+		 span_pair_vec_hash_lookup, vec_init);
+
+static int compare_span_pairs(const void *va, const void *vb)
+{
+	const struct span_pair *a = va, *b = vb;
+	if (a->old_sect != b->old_sect)
+		return a->old_sect < b->old_sect ? -1 : 1;
+	if (a->new_span != b->new_span)
+		return a->new_span < b->new_span ? -1 : 1;
+	if (a->old_span != b->old_span)
+		return a->old_span < b->old_span ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Call fn on every (old span, new span) pair of sections of the same
+ * type whose spans have equal keys, in the same order as iterating
+ * over new sections, old sections, new spans and old spans would.
+ * fn must do nothing for pairs whose keys differ.
+ */
 static void foreach_span_pair(struct superbfd *oldsbfd,
 			      struct superbfd *newsbfd,
 			      void (*fn)(struct span *old_span,
-					 struct span *new_span))
+					 struct span *new_span),
+			      const char *(*key)(struct span *span))
 {
 	asection *oldsect, *newsect;
 	struct supersect *oldss, *newss;
 	struct span *old_span, *new_span;
+	const char *k;
+
+	struct span_pair_vec_hash index;
+	span_pair_vec_hash_init(&index);
+	int old_sect = 0;
+	for (oldsect = oldsbfd->abfd->sections; oldsect != NULL;
+	     oldsect = oldsect->next, old_sect++) {
+		oldss = fetch_supersect(oldsbfd, oldsect);
+		for (old_span = oldss->spans.data;
+		     old_span < oldss->spans.data + oldss->spans.size;
+		     old_span++) {
+			k = key(old_span);
+			if (k == NULL)
+				continue;
+			struct span_pair *pair =
+			    vec_grow(span_pair_vec_hash_lookup(&index, k, TRUE),
+				     1);
+			pair->old_sect = old_sect;
+			pair->old_span = old_span;
+		}
+	}
+
+	struct span_pair_vec pairs;
+	vec_init(&pairs);
 	for (newsect = newsbfd->abfd->sections; newsect != NULL;
 	     newsect = newsect->next) {
 		newss = fetch_supersect(newsbfd, newsect);
-		for (oldsect = oldsbfd->abfd->sections; oldsect != NULL;
-		     oldsect = oldsect->next) {
-			oldss = fetch_supersect(oldsbfd, oldsect);
-			if (oldss->type != newss->type)
+		pairs.size = 0;
+		for (new_span = newss->spans.data;
+		     new_span < newss->spans.data + newss->spans.size;
+		     new_span++) {
+			k = key(new_span);
+			if (k == NULL)
 				continue;
-			for (new_span = newss->spans.data;
-			     new_span < newss->spans.data + newss->spans.size;
-			     new_span++) {
-				for (old_span = oldss->spans.data;
-				     old_span < oldss->spans.data +
-				     oldss->spans.size; old_span++)
-					fn(old_span, new_span);
+			struct span_pair_vec *bucket =
+			    span_pair_vec_hash_lookup(&index, k, FALSE);
+			if (bucket == NULL)
+				continue;
+			struct span_pair *pair;
+			for (pair = bucket->data;
+			     pair < bucket->data + bucket->size; pair++) {
+				struct span_pair *p = vec_grow(&pairs, 1);
+				*p = *pair;
+				p->new_span = new_span;
 			}
 		}
+		qsort(pairs.data, pairs.size, sizeof(*pairs.data),
+		      compare_span_pairs);
+
+		struct span_pair *pair;
+		bool same_type = false;
+		for (pair = pairs.data; pair < pairs.data + pairs.size;
+		     pair++) {
+			/* Section types can change as spans are matched, so
+			   compare them when we reach each old section */
+			if (pair == pairs.data ||
+			    pair[-1].old_sect != pair->old_sect)
+				same_type =
+				    pair->old_span->ss->type == newss->type;
+			if (same_type)
+				fn(pair->old_span, pair->new_span);
+		}
 	}
+	vec_free(&pairs);
+	span_pair_vec_hash_free(&index);
 }
 
-static void mark_new_spans(struct superbfd *sbfd)
+/*
+ * compare_matched_spans, update_nonzero_offsets and mark_new_spans are
+ * iterated to a fixpoint.  Each pass only revisits the spans queued for
+ * it, in the order a full pass would visit them.  A span is queued when
+ * its own state changes or when the match or patch status of a span it
+ * depends on changes.  Skipped spans would not change anything, so the
+ * result is the same as rescanning every section on every round.
+ *
+ * The dependencies are recorded as they are used: relocation targets in
+ * relocs_equal and handle_nonzero_offset_reloc, and CRC spans in
+ * compare_spans.
+ */
+struct span_node {
+	struct spanp_vec referrers;
+	unsigned long compare_order;
+	unsigned long offsets_order;
+};
+#define span_node_init(node) *(node) = (struct span_node)	\
+	{ { NULL, 0, 0 }, ULONG_MAX, ULONG_MAX }
+DEFINE_ADDR_HASH_TYPE(struct span_node, span_node_hash, span_node_hash_init,
+		      span_node_hash_free, span_node_hash_lookup,
+		      span_node_init);
+DEFINE_ADDR_HASH_TYPE(bool, span_edge_hash, span_edge_hash_init,
+		      span_edge_hash_free, span_edge_hash_lookup, bool_init);
+
+/* A min-heap of pass positions */
+struct span_queue {
+	struct ulong_vec heap;
+	bool *queued;
+};
+
+/* A unit of update_nonzero_offsets: a span, or a section whose spans
+   overlap (span == NULL) */
+struct offsets_unit {
+	struct supersect *ss;
+	struct span *span;
+};
+DECLARE_VEC_TYPE(struct offsets_unit, offsets_unit_vec);
+
+enum worklist_pass { PASS_NONE, PASS_COMPARE, PASS_OFFSETS };
+
+static struct {
+	struct superbfd *sbfd;
+	enum worklist_pass pass;
+	unsigned long cursor;
+	struct span_node_hash nodes;
+	struct span_edge_hash edges;
+	struct spanp_vec compare_spans;
+	struct offsets_unit_vec offsets_units;
+	struct span_queue compare, compare_pending;
+	struct span_queue offsets, offsets_pending;
+	struct spanp_vec unmatched;
+} worklist;
+
+static void init_span_queue(struct span_queue *q, size_t n)
+{
+	vec_init(&q->heap);
+	q->queued = calloc(n + 1, sizeof(*q->queued));
+	assert(q->queued != NULL);
+}
+
+static void free_span_queue(struct span_queue *q)
+{
+	vec_free(&q->heap);
+	free(q->queued);
+}
+
+static void span_queue_push(struct span_queue *q, unsigned long order)
+{
+	if (q->queued[order])
+		return;
+	q->queued[order] = true;
+	size_t i = q->heap.size;
+	vec_grow(&q->heap, 1);
+	while (i > 0 && q->heap.data[(i - 1) / 2] > order) {
+		q->heap.data[i] = q->heap.data[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	q->heap.data[i] = order;
+}
+
+static unsigned long span_queue_pop(struct span_queue *q)
+{
+	unsigned long *heap = q->heap.data;
+	unsigned long order = heap[0], last = heap[--q->heap.size];
+	size_t i = 0, n = q->heap.size;
+	while (2 * i + 1 < n) {
+		size_t child = 2 * i + 1;
+		if (child + 1 < n && heap[child + 1] < heap[child])
+			child++;
+		if (heap[child] >= last)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (n > 0)
+		heap[i] = last;
+	q->queued[order] = false;
+	return order;
+}
+
+/* Start a pass: the spans queued for it become the current queue */
+static void start_span_pass(enum worklist_pass pass, struct span_queue *q,
+			    struct span_queue *pending)
+{
+	assert(q->heap.size == 0);
+	struct span_queue tmp = *q;
+	*q = *pending;
+	*pending = tmp;
+	worklist.pass = pass;
+	worklist.cursor = 0;
+}
+
+static void queue_span_pass(enum worklist_pass pass, unsigned long order,
+			    struct span_queue *q, struct span_queue *pending)
 {
+	if (order == ULONG_MAX)
+		return;
+	if (worklist.pass == pass && order > worklist.cursor)
+		span_queue_push(q, order);
+	else
+		span_queue_push(pending, order);
+}
+
+static void queue_span(struct span *span)
+{
+	struct span_node *node =
+	    span_node_hash_lookup(&worklist.nodes, span, 0, FALSE);
+	if (node == NULL)
+		return;
+	queue_span_pass(PASS_COMPARE, node->compare_order, &worklist.compare,
+			&worklist.compare_pending);
+	queue_span_pass(PASS_OFFSETS, node->offsets_order, &worklist.offsets,
+			&worklist.offsets_pending);
+}
+
+static void init_span_worklist(struct superbfd *sbfd)
+{
+	worklist.sbfd = sbfd;
+	worklist.pass = PASS_NONE;
+	span_node_hash_init(&worklist.nodes);
+	span_edge_hash_init(&worklist.edges);
+	vec_init(&worklist.compare_spans);
+	vec_init(&worklist.offsets_units);
+	vec_init(&worklist.unmatched);
+
 	asection *sect;
+	struct span *span;
 	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(sbfd, sect);
-		if (ss->type == SS_TYPE_SPECIAL || ss->type == SS_TYPE_IGNORED)
-			continue;
-		struct span *span;
 		for (span = ss->spans.data;
 		     span < ss->spans.data + ss->spans.size; span++) {
-			if (span->match == NULL)
-				span->new = true;
+			span_node_hash_lookup(&worklist.nodes, span, 0,
+					      TRUE)->compare_order =
+			    worklist.compare_spans.size;
+			*vec_grow(&worklist.compare_spans, 1) = span;
+			*vec_grow(&worklist.unmatched, 1) = span;
+		}
+		if (ss->type == SS_TYPE_SPECIAL || ss->type == SS_TYPE_IGNORED)
+			continue;
+
+		update_span_index(ss);
+		struct offsets_unit *unit;
+		if (ss->spans_overlap) {
+			unit = vec_grow(&worklist.offsets_units, 1);
+			unit->ss = ss;
+			unit->span = NULL;
+			for (span = ss->spans.data;
+			     span < ss->spans.data + ss->spans.size; span++)
+				span_node_hash_lookup(&worklist.nodes, span, 0,
+						      FALSE)->offsets_order =
+				    worklist.offsets_units.size - 1;
+			continue;
+		}
+		unsigned long *idx;
+		for (idx = ss->span_index.data;
+		     idx < ss->span_index.data + ss->span_index.size; idx++) {
+			unit = vec_grow(&worklist.offsets_units, 1);
+			unit->ss = ss;
+			unit->span = &ss->spans.data[*idx];
+			span_node_hash_lookup(&worklist.nodes, unit->span, 0,
+					      FALSE)->offsets_order =
+			    worklist.offsets_units.size - 1;
+		}
+	}
+
+	init_span_queue(&worklist.compare, worklist.compare_spans.size);
+	init_span_queue(&worklist.compare_pending,
+			worklist.compare_spans.size);
+	init_span_queue(&worklist.offsets, worklist.offsets_units.size);
+	init_span_queue(&worklist.offsets_pending,
+			worklist.offsets_units.size);
+	unsigned long i;
+	for (i = 0; i < worklist.compare_spans.size; i++)
+		span_queue_push(&worklist.compare_pending, i);
+	for (i = 0; i < worklist.offsets_units.size; i++)
+		span_queue_push(&worklist.offsets_pending, i);
+}
+
+static void free_span_worklist(void)
+{
+	struct span_node_hash_entry *e;
+	for (e = worklist.nodes.entries;
+	     e < worklist.nodes.entries + worklist.nodes.size; e++) {
+		if (e->used)
+			vec_free(&e->val.referrers);
+	}
+	span_node_hash_free(&worklist.nodes);
+	span_edge_hash_free(&worklist.edges);
+	vec_free(&worklist.compare_spans);
+	vec_free(&worklist.offsets_units);
+	vec_free(&worklist.unmatched);
+	free_span_queue(&worklist.compare);
+	free_span_queue(&worklist.compare_pending);
+	free_span_queue(&worklist.offsets);
+	free_span_queue(&worklist.offsets_pending);
+	worklist.sbfd = NULL;
+}
+
+/* Record that the results for span depend on the state of target */
+static void add_span_dependency(struct span *target, struct span *span)
+{
+	if (worklist.sbfd == NULL || target == NULL)
+		return;
+	bool *seen = span_edge_hash_lookup(&worklist.edges, target,
+					   (unsigned long)span, TRUE);
+	if (*seen)
+		return;
+	*seen = true;
+	struct span_node *node =
+	    span_node_hash_lookup(&worklist.nodes, target, 0, TRUE);
+	*vec_grow(&node->referrers, 1) = span;
+}
+
+/* Queue everything that depends on the match or patch status of span */
+static void span_changed(struct span *span)
+{
+	if (worklist.sbfd == NULL)
+		return;
+	if (span->ss->parent == worklist.sbfd) {
+		queue_span(span);
+		if (span->match == NULL)
+			*vec_grow(&worklist.unmatched, 1) = span;
+	}
+
+	struct span_node *node =
+	    span_node_hash_lookup(&worklist.nodes, span, 0, FALSE);
+	if (node == NULL)
+		return;
+	struct span **referrer;
+	for (referrer = node->referrers.data;
+	     referrer < node->referrers.data + node->referrers.size;
+	     referrer++) {
+		if ((*referrer)->ss->parent == worklist.sbfd)
+			queue_span(*referrer);
+		else if ((*referrer)->match != NULL)
+			queue_span((*referrer)->match);
+	}
+}
+
+static void mark_new_spans(struct superbfd *sbfd)
+{
+	struct span **spanp;
+	for (spanp = worklist.unmatched.data;
+	     spanp < worklist.unmatched.data + worklist.unmatched.size;
+	     spanp++) {
+		struct span *span = *spanp;
+		struct supersect *ss = span->ss;
+		if (ss->type == SS_TYPE_SPECIAL || ss->type == SS_TYPE_IGNORED)
+			continue;
+		if (span->match == NULL && !span->new) {
+			span->new = true;
+			queue_span(span);
 		}
 	}
+	worklist.unmatched.size = 0;
 }
 
 static void handle_deleted_spans(struct superbfd *oldsbfd,
@@ -934,48 +1798,80 @@ static void handle_deleted_spans(struct superbfd *oldsbfd,
 	}
 }
 
-static void handle_nonzero_offset_relocs(struct supersect *ss)
+static void handle_nonzero_offset_reloc(struct supersect *ss,
+					struct span *address_span,
+					arelent *reloc)
 {
-	struct span *address_span, *target_span;
-	arelent **relocp;
-	for (relocp = ss->relocs.data;
-	     relocp < ss->relocs.data + ss->relocs.size; relocp++) {
-		arelent *reloc = *relocp;
-		address_span = find_span(ss, reloc->address);
-		if (!address_span->new && !address_span->patch)
-			continue;
+	struct span *target_span;
+	if (!address_span->new && !address_span->patch)
+		return;
 
-		asymbol *sym = *reloc->sym_ptr_ptr;
-		if (bfd_is_const_section(sym->section))
-			continue;
-		bfd_vma offset = reloc_target_offset(ss, reloc);
-		target_span = reloc_target_span(ss, reloc);
-		if (sym->value + offset == target_span->start)
-			continue;
+	asymbol *sym = *reloc->sym_ptr_ptr;
+	if (bfd_is_const_section(sym->section))
+		return;
+	bfd_vma offset = reloc_target_offset(ss, reloc);
+	target_span = reloc_target_span(ss, reloc);
+	add_span_dependency(target_span, address_span);
+	if (sym->value + offset == target_span->start)
+		return;
 
-		if (target_span->ss->type != SS_TYPE_TEXT)
-			continue;
-		if (target_span->patch)
-			continue;
+	if (target_span->ss->type != SS_TYPE_TEXT)
+		return;
+	if (target_span->patch)
+		return;
 
-		target_span->patch = true;
-		changed = true;
-		debug1(ss->parent, "Changing %s because a relocation from sect "
-		       "%s has a nonzero offset %lx+%lx into it\n",
-		       target_span->label, ss->name, (unsigned long)sym->value,
-		       (unsigned long)offset);
+	target_span->patch = true;
+	changed = true;
+	span_changed(target_span);
+	debug1(ss->parent, "Changing %s because a relocation from sect "
+	       "%s has a nonzero offset %lx+%lx into it\n",
+	       target_span->label, ss->name, (unsigned long)sym->value,
+	       (unsigned long)offset);
+}
+
+static void handle_nonzero_offset_relocs(struct supersect *ss)
+{
+	update_span_index(ss);
+	if (ss->spans_overlap) {
+		arelent **relocp;
+		for (relocp = ss->relocs.data;
+		     relocp < ss->relocs.data + ss->relocs.size; relocp++)
+			handle_nonzero_offset_reloc
+			    (ss, find_span(ss, (*relocp)->address), *relocp);
+		return;
+	}
+
+	/* Visiting spans in address order visits relocations in order */
+	unsigned long *idx;
+	for (idx = ss->span_index.data;
+	     idx < ss->span_index.data + ss->span_index.size; idx++) {
+		struct span *span = &ss->spans.data[*idx];
+		size_t i;
+		for (i = span->first_reloc; i < span->last_reloc; i++)
+			handle_nonzero_offset_reloc(ss, span,
+						    span_relocs(ss)[i]);
 	}
 }
 
 static void update_nonzero_offsets(struct superbfd *sbfd)
 {
-	asection *sect;
-	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
-		struct supersect *ss = fetch_supersect(sbfd, sect);
-		if (ss->type == SS_TYPE_SPECIAL || ss->type == SS_TYPE_IGNORED)
+	start_span_pass(PASS_OFFSETS, &worklist.offsets,
+			&worklist.offsets_pending);
+	while (worklist.offsets.heap.size > 0) {
+		worklist.cursor = span_queue_pop(&worklist.offsets);
+		struct offsets_unit *unit =
+		    &worklist.offsets_units.data[worklist.cursor];
+		if (unit->span == NULL) {
+			handle_nonzero_offset_relocs(unit->ss);
 			continue;
-		handle_nonzero_offset_relocs(ss);
+		}
+		size_t i;
+		for (i = unit->span->first_reloc; i < unit->span->last_reloc;
+		     i++)
+			handle_nonzero_offset_reloc(unit->ss, unit->span,
+						    span_relocs(unit->ss)[i]);
 	}
+	worklist.pass = PASS_NONE;
 }
 
 static void unmatch_addr_spans(struct span *old_span, struct span *new_span,
@@ -994,6 +1890,7 @@ static void unmatch_addr_spans(struct span *old_span, struct span *new_span,
 			       "to relocations from special section %s\n",
 			       new_sym_span->label, new_span->label);
 			new_sym_span->patch = true;
+			span_changed(new_sym_span);
 		} else {
 			debug1(new_span->ss->parent, "Unmatching %s and %s due "
 			       "to relocations from special section %s/%s\n",
@@ -1009,8 +1906,32 @@ static void compare_spans(struct span *old_span, struct span *new_span)
 {
 	struct superbfd *newsbfd = new_span->ss->parent;
 
-	bool nonrelocs_match = nonrelocs_equal(old_span, new_span);
-	bool relocs_match = all_relocs_equal(old_span, new_span);
+	if (!old_span->hashed)
+		init_span_hash(old_span);
+	if (!new_span->hashed)
+		init_span_hash(new_span);
+
+	/* Differing hashes of the same quantity settle a comparison */
+	bool nonrelocs_match;
+	deep_compares++;
+	if (old_span->contents_size == new_span->contents_size &&
+	    old_span->content_hash != new_span->content_hash &&
+	    reloc_masks_equal(old_span, new_span)) {
+		nonrelocs_match = false;
+		deep_compares_avoided++;
+	} else if (new_span->nonrelocs_checked == old_span) {
+		nonrelocs_match = new_span->nonrelocs_same;
+	} else {
+		nonrelocs_match = nonrelocs_equal(old_span, new_span);
+	}
+	bool relocs_match;
+	deep_compares++;
+	if (old_span->reloc_hash != new_span->reloc_hash) {
+		relocs_match = false;
+		deep_compares_avoided++;
+	} else {
+		relocs_match = all_relocs_equal(old_span, new_span);
+	}
 	if (nonrelocs_match && relocs_match) {
 		const struct table_section *ts =
 		    get_table_section(old_span->ss->name);
@@ -1019,6 +1940,8 @@ static void compare_spans(struct span *old_span, struct span *new_span)
 			struct span *new_crc_span = get_crc_span(new_span, ts);
 			assert(old_crc_span != NULL);
 			assert(new_crc_span != NULL);
+			add_span_dependency(old_crc_span, old_span);
+			add_span_dependency(new_crc_span, new_span);
 			if (old_crc_span->match != new_crc_span ||
 			    new_crc_span->match != old_crc_span) {
 				debug1(newsbfd, "Unmatching %s and %s due to "
@@ -1069,13 +1992,43 @@ static void compare_spans(struct span *old_span, struct span *new_span)
 		unmatch_span(old_span);
 	}
 	changed = true;
+	span_changed(new_span);
 	if (unchangeable_section(new_span->ss))
 		err(newsbfd, "warning: ignoring change to nonpatchable "
 		    "section %s\n", new_span->ss->name);
 }
 
-static void compare_matched_spans(struct superbfd *newsbfd)
+static void hash_span_worker(size_t i, void *arg)
 {
+	struct spanp_vec *spans = arg;
+	init_span_hash(spans->data[i]);
+}
+
+static void nonrelocs_equal_worker(size_t i, void *arg)
+{
+	struct spanp_vec *spans = arg;
+	struct span *new_span = spans->data[i];
+	struct span *old_span = new_span->match;
+	if (old_span->contents_size == new_span->contents_size &&
+	    old_span->content_hash != new_span->content_hash &&
+	    reloc_masks_equal(old_span, new_span))
+		return;
+	new_span->nonrelocs_same = nonrelocs_equal(old_span, new_span);
+	new_span->nonrelocs_checked = old_span;
+}
+
+/*
+ * Do the libbfd-free part of the first round of compare_spans for every
+ * matched pair across parallel_for: hash both spans, then run
+ * nonrelocs_equal where the hashes cannot settle it.  Each pair only
+ * writes to its own spans, and compare_spans consumes the results in
+ * its usual order, so the output does not depend on the thread count.
+ */
+static void precompare_matched_spans(struct superbfd *newsbfd)
+{
+	struct spanp_vec matched, hash;
+	vec_init(&matched);
+	vec_init(&hash);
 	asection *sect;
 	for (sect = newsbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(newsbfd, sect);
@@ -1084,9 +2037,34 @@ static void compare_matched_spans(struct superbfd *newsbfd)
 		     span < ss->spans.data + ss->spans.size; span++) {
 			if (span->match == NULL)
 				continue;
-			compare_spans(span->match, span);
+			*vec_grow(&matched, 1) = span;
+			if (!span->hashed)
+				*vec_grow(&hash, 1) = span;
+			/* Matches are one-to-one, so nothing is hashed twice */
+			assert(span->match->match == span);
+			if (!span->match->hashed)
+				*vec_grow(&hash, 1) = span->match;
 		}
 	}
+
+	parallel_for(hash.size, hash_span_worker, &hash);
+	parallel_for(matched.size, nonrelocs_equal_worker, &matched);
+	vec_free(&hash);
+	vec_free(&matched);
+}
+
+static void compare_matched_spans(struct superbfd *newsbfd)
+{
+	start_span_pass(PASS_COMPARE, &worklist.compare,
+			&worklist.compare_pending);
+	while (worklist.compare.heap.size > 0) {
+		worklist.cursor = span_queue_pop(&worklist.compare);
+		struct span *span = worklist.compare_spans.data[worklist.cursor];
+		if (span->match == NULL)
+			continue;
+		compare_spans(span->match, span);
+	}
+	worklist.pass = PASS_NONE;
 }
 
 static void handle_section_symbol_renames(struct superbfd *oldsbfd,
@@ -1100,10 +2078,10 @@ static void handle_section_symbol_renames(struct superbfd *oldsbfd,
 		     span < ss->spans.data + ss->spans.size; span++) {
 			if (span->match == NULL)
 				continue;
-			if (strcmp(span->label, span->match->label) == 0)
+			if (span->label == span->match->label)
 				continue;
-			if (strcmp(span->orig_label, span->label) != 0 &&
-			    strcmp(span->label, span->match->label) != 0)
+			if (span->orig_label != span->label &&
+			    span->label != span->match->label)
 				DIE;
 			if (span->symbol != NULL)
 				label_map_set(newsbfd, span->label,
@@ -1208,17 +2186,131 @@ static void compute_entry_points(struct superbfd *sbfd)
 
 static bool part_of_reloc(struct supersect *ss, unsigned long addr)
 {
-	arelent **relocp;
-	for (relocp = ss->relocs.data;
-	     relocp < ss->relocs.data + ss->relocs.size; relocp++) {
-		arelent *reloc = *relocp;
-		if (addr >= reloc->address &&
-		    addr < reloc->address + bfd_get_reloc_size(reloc->howto))
+	arelent **relocs = span_relocs(ss);
+	size_t lo = 0, hi = ss->span_relocs.size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (relocs[mid]->address <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* init_span_relocs checks that only same-address relocations overlap */
+	while (lo > 0) {
+		arelent *reloc = relocs[--lo];
+		if (addr < reloc->address + bfd_get_reloc_size(reloc->howto))
 			return true;
+		if (lo == 0 || relocs[lo - 1]->address != reloc->address)
+			break;
 	}
 	return false;
 }
 
+#define HASH_INIT 2166136261UL
+static unsigned long hash_ulong(unsigned long h, unsigned long x)
+{
+	size_t i;
+	for (i = 0; i < sizeof(x); i++, x >>= 8)
+		h = (h ^ (x & 0xff)) * 16777619UL;
+	return h;
+}
+
+/* Extend the mask by [begin, end), relative to the span's start */
+static void add_reloc_mask(struct span *span, bfd_vma begin, bfd_vma end)
+{
+	struct ulong_vec *mask = &span->reloc_mask;
+	if (mask->size > 0 && mask->data[mask->size - 1] == begin) {
+		mask->data[mask->size - 1] = end;
+		return;
+	}
+	unsigned long *interval = vec_grow(mask, 2);
+	interval[0] = begin;
+	interval[1] = end;
+}
+
+/*
+ * Summarize a span for compare_spans.  reloc_mask lists the bytes that
+ * part_of_reloc considers part of a relocation, content_hash hashes the
+ * contents with those bytes zeroed, and reloc_hash hashes everything
+ * that relocs_equal checks without looking at relocation targets.
+ */
+static void init_span_hash(struct span *span)
+{
+	struct supersect *ss = span->ss;
+	arelent **relocs = span_relocs(ss);
+	size_t n = ss->span_relocs.size;
+	const unsigned char *data = ss->contents.data;
+	bfd_vma start = span->start, end = start + span->contents_size;
+
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (relocs[mid]->address <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Bytes before cover belong to the nearest preceding relocations */
+	bfd_vma cover = 0;
+	size_t k;
+	for (k = lo; k > 0 && relocs[k - 1]->address == relocs[lo - 1]->address;
+	     k--) {
+		arelent *reloc = relocs[k - 1];
+		if (cover < reloc->address + bfd_get_reloc_size(reloc->howto))
+			cover = reloc->address +
+			    bfd_get_reloc_size(reloc->howto);
+	}
+
+	vec_init(&span->reloc_mask);
+	unsigned long h = HASH_INIT;
+	bfd_vma p = start;
+	k = lo;
+	while (p < end) {
+		bfd_vma next = k < n && relocs[k]->address < end ?
+		    relocs[k]->address : end;
+		bfd_vma masked = cover < next ? cover : next;
+		if (masked > p) {
+			add_reloc_mask(span, p - start, masked - start);
+			for (; p < masked; p++)
+				h *= 16777619UL;
+		}
+		for (; p < next; p++)
+			h = (h ^ data[p]) * 16777619UL;
+		if (p == end)
+			break;
+		cover = p;
+		for (; k < n && relocs[k]->address == p; k++) {
+			bfd_vma reloc_end =
+			    p + bfd_get_reloc_size(relocs[k]->howto);
+			if (cover < reloc_end)
+				cover = reloc_end;
+		}
+	}
+	span->content_hash = h;
+
+	h = HASH_INIT;
+	size_t i;
+	for (i = span->first_reloc; i < span->last_reloc; i++) {
+		arelent *reloc = relocs[i];
+		h = hash_ulong(h, reloc->address - start);
+		h = hash_ulong(h, (unsigned long)reloc->howto);
+		h = hash_ulong(h, non_dst_mask(ss, reloc));
+	}
+	if (span->first_reloc != SIZE_MAX)
+		h = hash_ulong(h, span->last_reloc - span->first_reloc);
+	span->reloc_hash = h;
+	span->hashed = true;
+}
+
+static bool reloc_masks_equal(struct span *old_span, struct span *new_span)
+{
+	struct ulong_vec *old = &old_span->reloc_mask;
+	struct ulong_vec *new = &new_span->reloc_mask;
+	return old->size == new->size &&
+	    memcmp(old->data, new->data, old->size * sizeof(*old->data)) == 0;
+}
+
 static bool nonrelocs_equal(struct span *old_span, struct span *new_span)
 {
 	int i;
@@ -1284,7 +2376,7 @@ bool relocs_equal(struct supersect *old_src_ss, struct supersect *new_src_ss,
 		    fetch_supersect(oldsbfd, old_sect)->type == SS_TYPE_TEXT)
 			return false;
 
-		return strcmp(old_sym->name, new_sym->name) == 0 &&
+		return old_sym->name == new_sym->name &&
 		    old_offset == new_offset;
 	}
 
@@ -1306,6 +2398,8 @@ bool relocs_equal(struct supersect *old_src_ss, struct supersect *new_src_ss,
 	struct supersect *new_ss = fetch_supersect(newsbfd, new_sect);
 	struct span *old_span = reloc_target_span(old_src_ss, old_reloc);
 	struct span *new_span = reloc_target_span(new_src_ss, new_reloc);
+	add_span_dependency(old_span, old_addr_span);
+	add_span_dependency(new_span, new_addr_span);
 
 	if (old_span->match != new_span || new_span->match != old_span) {
 		debug1(newsbfd, "Nonmatching relocs from %s to %s/%s\n",
@@ -1340,35 +2434,16 @@ bool relocs_equal(struct supersect *old_src_ss, struct supersect *new_src_ss,
 bool all_relocs_equal(struct span *old_span, struct span *new_span)
 {
 	struct supersect *old_ss = old_span->ss, *new_ss = new_span->ss;
-	arelent **old_relocp, **new_relocp;
-
-	for (old_relocp = old_ss->relocs.data;
-	     old_relocp < old_ss->relocs.data + old_ss->relocs.size;
-	     old_relocp++) {
-		if (find_span(old_ss, (*old_relocp)->address) == old_span)
-			break;
-	}
+	size_t old_i = old_span->first_reloc, new_i = new_span->first_reloc;
 
-	for (new_relocp = new_ss->relocs.data;
-	     new_relocp < new_ss->relocs.data + new_ss->relocs.size;
-	     new_relocp++) {
-		if (find_span(new_ss, (*new_relocp)->address) == new_span)
-			break;
-	}
-
-	for (; old_relocp < old_ss->relocs.data + old_ss->relocs.size &&
-	     find_span(old_ss, (*old_relocp)->address) == old_span &&
-	     new_relocp < new_ss->relocs.data + new_ss->relocs.size &&
-	     find_span(new_ss, (*new_relocp)->address) == new_span;
-	     old_relocp++, new_relocp++) {
-		if (!relocs_equal(old_ss, new_ss, *old_relocp, *new_relocp))
+	for (; old_i < old_span->last_reloc && new_i < new_span->last_reloc;
+	     old_i++, new_i++) {
+		if (!relocs_equal(old_ss, new_ss, span_relocs(old_ss)[old_i],
+				  span_relocs(new_ss)[new_i]))
 			return false;
 	}
 
-	if ((old_relocp < old_ss->relocs.data + old_ss->relocs.size &&
-	     find_span(old_ss, (*old_relocp)->address) == old_span) ||
-	    (new_relocp < new_ss->relocs.data + new_ss->relocs.size &&
-	     find_span(new_ss, (*new_relocp)->address) == new_span)) {
+	if (old_i < old_span->last_reloc || new_i < new_span->last_reloc) {
 		debug1(new_ss->parent, "Different reloc count between %s and "
 		       "%s\n", old_span->label, new_span->label);
 		return false;
@@ -1410,6 +2485,7 @@ void rm_relocs(struct superbfd *isbfd)
 
 void rm_some_relocs(struct supersect *ss)
 {
+	vec_init(&ss->span_relocs);
 	struct arelentp_vec orig_relocs;
 	vec_move(&orig_relocs, &ss->relocs);
 
@@ -1475,6 +2551,19 @@ void rm_some_relocs(struct supersect *ss)
 	}
 }
 
+struct supersect *find_section(struct superbfd *sbfd, const char *name)
+{
+	asection *sect = bfd_get_section_by_name(sbfd->abfd, name);
+	if (sect != NULL)
+		return fetch_supersect(sbfd, sect);
+	struct supersect *ss;
+	for (ss = sbfd->new_supersects; ss != NULL; ss = ss->next) {
+		if (strcmp(ss->name, name) == 0)
+			return ss;
+	}
+	return NULL;
+}
+
 struct supersect *make_section(struct superbfd *sbfd, const char *fmt, ...)
 {
 	va_list ap;
@@ -1504,7 +2593,7 @@ arelent *create_reloc(struct supersect *ss, const void *addr, asymbol **symp,
 		DIE;
 	}
 
-	arelent *reloc = malloc(sizeof(*reloc));
+	arelent *reloc = arena_alloc(sizeof(*reloc));
 	reloc->sym_ptr_ptr = symp;
 	reloc->address = addr_offset(ss, addr);
 	reloc->howto = bfd_reloc_type_lookup(ss->parent->abfd, code);
@@ -1540,45 +2629,61 @@ void write_string(struct supersect *ss, const char **addr, const char *fmt, ...)
 	write_reloc(ss, addr, &str_ss->symbol, *str_offp);
 }
 
-void lookup_system_map(struct addr_vec *addrs, const char *name, long offset)
+/* Add the System.map addresses of name plus offset to addrs, once each */
+void lookup_system_map(struct addr_vec *addrs, struct bool_addr_hash *seen,
+		       const char *name, long offset)
 {
-	struct addr_vec *map_addrs =
-	    addr_vec_hash_lookup(&system_map, name, FALSE);
+	size_t nr_map_addrs;
+	const unsigned long *map_addrs = system_map_addrs(name, &nr_map_addrs);
 	if (map_addrs == NULL)
 		return;
 
-	unsigned long *addr, *map_addr;
-	for (map_addr = map_addrs->data;
-	     map_addr < map_addrs->data + map_addrs->size; map_addr++) {
-		for (addr = addrs->data; addr < addrs->data + addrs->size;
-		     addr++) {
-			if (*addr == *map_addr + offset)
-				break;
-		}
-		if (addr < addrs->data + addrs->size)
+	const unsigned long *map_addr;
+	for (map_addr = map_addrs; map_addr < map_addrs + nr_map_addrs;
+	     map_addr++) {
+		unsigned long addr = *map_addr + offset;
+		bool *found = bool_addr_hash_lookup(seen, NULL, addr, TRUE);
+		if (*found)
 			continue;
-		*vec_grow(addrs, 1) = *map_addr + offset;
+		*found = true;
+		*vec_grow(addrs, 1) = addr;
 	}
 }
 
+static int compare_addrs(const void *va, const void *vb)
+{
+	const unsigned long *a = va, *b = vb;
+	if (*a != *b)
+		return *a < *b ? -1 : 1;
+	return 0;
+}
+
+/* The candidate addresses for sym, sorted and without duplicates */
 void compute_system_map_array(struct superbfd *sbfd, struct addr_vec *addrs,
 			      asymbol *sym)
 {
 	if (bfd_is_abs_section(sym->section)) {
 		*vec_grow(addrs, 1) = sym->value;
 	} else if (bfd_is_und_section(sym->section)) {
-		lookup_system_map(addrs, sym->name, 0);
+		struct bool_addr_hash seen;
+		bool_addr_hash_init(&seen);
+		lookup_system_map(addrs, &seen, sym->name, 0);
+		bool_addr_hash_free(&seen);
 	} else if (!bfd_is_const_section(sym->section)) {
+		struct bool_addr_hash seen;
+		bool_addr_hash_init(&seen);
+		struct asymbolp_vec *syms = section_syms(sbfd, sym->section);
 		asymbol **gsymp;
-		for (gsymp = sbfd->syms.data;
-		     gsymp < sbfd->syms.data + sbfd->syms.size; gsymp++) {
+		for (gsymp = syms->data; gsymp < syms->data + syms->size;
+		     gsymp++) {
 			asymbol *gsym = *gsymp;
-			if ((gsym->flags & BSF_DEBUGGING) == 0 &&
-			    gsym->section == sym->section)
-				lookup_system_map(addrs, gsym->name,
+			if ((gsym->flags & BSF_DEBUGGING) == 0)
+				lookup_system_map(addrs, &seen, gsym->name,
 						  sym->value - gsym->value);
 		}
+		bool_addr_hash_free(&seen);
 	}
+	qsort(addrs->data, addrs->size, sizeof(*addrs->data), compare_addrs);
 }
 
 void write_ksplice_system_map(struct superbfd *sbfd, asymbol *sym,
@@ -1842,73 +2947,544 @@ static void write_table_relocs(struct superbfd *sbfd, const char *sectname,
 		if (!span->keep)
 			continue;
 
-		arelent *reloc = find_reloc(ss, entry + s->addr_offset);
-		assert(reloc != NULL);
-		asymbol *sym = *reloc->sym_ptr_ptr;
-		assert(!bfd_is_const_section(sym->section));
-		struct supersect *sym_ss = fetch_supersect(sbfd, sym->section);
-		unsigned long addr = sym->value +
-		    reloc_target_offset(ss, reloc);
-		write_ksplice_table_reloc(sym_ss, addr, span->label, type);
+		arelent *reloc = find_reloc(ss, entry + s->addr_offset);
+		assert(reloc != NULL);
+		asymbol *sym = *reloc->sym_ptr_ptr;
+		assert(!bfd_is_const_section(sym->section));
+		struct supersect *sym_ss = fetch_supersect(sbfd, sym->section);
+		unsigned long addr = sym->value +
+		    reloc_target_offset(ss, reloc);
+		write_ksplice_table_reloc(sym_ss, addr, span->label, type);
+	}
+}
+
+static void write_ksplice_table_reloc(struct supersect *ss,
+				      unsigned long address,
+				      const char *label,
+				      enum ksplice_reloc_howto_type type)
+{
+	struct supersect *kreloc_ss;
+	kreloc_ss = make_section(ss->parent, ".ksplice_relocs%s", ss->name);
+	struct ksplice_reloc *kreloc = sect_grow(kreloc_ss, 1,
+						 struct ksplice_reloc);
+	struct span *span = find_span(ss, address);
+	assert(span != NULL);
+
+	write_ksplice_symbol_backend(kreloc_ss, &kreloc->symbol, NULL,
+				     label, NULL);
+	write_reloc(kreloc_ss, &kreloc->blank_addr, &ss->symbol,
+		    address + span->shift);
+	write_ksplice_nonreloc_howto(kreloc_ss, &kreloc->howto, type, 0);
+}
+
+static void write_ksplice_nonreloc_howto(struct supersect *ss,
+					 const struct ksplice_reloc_howto
+					 *const *addr,
+					 enum ksplice_reloc_howto_type type,
+					 int size)
+{
+	struct supersect *khowto_ss =
+	    make_section(ss->parent, ".ksplice_reloc_howtos");
+	struct ksplice_reloc_howto *khowto =
+	    sect_grow(khowto_ss, 1, struct ksplice_reloc_howto);
+
+	khowto->type = type;
+	khowto->size = size;
+	khowto->pcrel = 0;
+	khowto->dst_mask = 0;
+	khowto->rightshift = 0;
+	khowto->signed_addend = 0;
+	write_reloc(ss, addr, &khowto_ss->symbol,
+		    addr_offset(khowto_ss, khowto));
+}
+
+static void write_ksplice_symbol_reloc(struct supersect *ss,
+				       const char *sectname,
+				       unsigned long *addr, asymbol *sym,
+				       const char *label, const char *name)
+{
+	struct supersect *kreloc_ss;
+	kreloc_ss = make_section(ss->parent, ".ksplice_relocs%s", sectname);
+	struct ksplice_reloc *kreloc = sect_grow(kreloc_ss, 1,
+						 struct ksplice_reloc);
+
+	write_ksplice_symbol_backend(kreloc_ss, &kreloc->symbol, sym, label,
+				     name);
+	write_reloc(kreloc_ss, &kreloc->blank_addr, &ss->symbol,
+		    addr_offset(ss, addr));
+	write_ksplice_nonreloc_howto(kreloc_ss, &kreloc->howto,
+				     KSPLICE_HOWTO_SYMBOL, 0);
+}
+
+struct encoded_reloc {
+	struct supersect *ss;
+	bfd_vma offset;
+	int size;
+	unsigned long howto;
+	unsigned long symbol;
+	long insn_addend;
+	long target_addend;
+};
+DECLARE_VEC_TYPE(struct encoded_reloc, encoded_reloc_vec);
+DECLARE_VEC_TYPE(struct ksplice_reloc_howto, ksplice_reloc_howto_vec);
+DECLARE_VEC_TYPE(struct ksplice_reloc_run, ksplice_reloc_run_vec);
+DECLARE_VEC_TYPE(unsigned char, byte_vec);
+
+static void write_uleb128(struct byte_vec *buf, unsigned long val)
+{
+	do {
+		unsigned char byte = val & 0x7f;
+		val >>= 7;
+		if (val != 0)
+			byte |= 0x80;
+		*vec_grow(buf, 1) = byte;
+	} while (val != 0);
+}
+
+static void write_sleb128(struct byte_vec *buf, long val)
+{
+	bool more;
+	do {
+		unsigned char byte = val & 0x7f;
+		val >>= 7;
+		more = !((val == 0 && (byte & 0x40) == 0) ||
+			 (val == -1 && (byte & 0x40) != 0));
+		if (more)
+			byte |= 0x80;
+		*vec_grow(buf, 1) = byte;
+	} while (more);
+}
+
+static int compare_encoded_relocs(const void *aptr, const void *bptr)
+{
+	const struct encoded_reloc *a = aptr, *b = bptr;
+	int aindex = a->ss->symbol->section->index;
+	int bindex = b->ss->symbol->section->index;
+	if (aindex != bindex)
+		return aindex - bindex;
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	return a->size - b->size;
+}
+
+static void sort_relocs(struct arelentp_vec *relocs)
+{
+	qsort(relocs->data, relocs->size, sizeof(*relocs->data),
+	      compare_reloc_addresses);
+}
+
+/* Sort the new relocations of every section for read_finalized_pointer */
+static void sort_new_relocs(struct superbfd *sbfd)
+{
+	asection *sect;
+	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next)
+		sort_relocs(&fetch_supersect(sbfd, sect)->new_relocs);
+	struct supersect *ss;
+	for (ss = sbfd->new_supersects; ss != NULL; ss = ss->next)
+		sort_relocs(&ss->new_relocs);
+}
+
+/* Find the section and offset that a pointer in a Ksplice section refers
+   to during finalize.  rm_relocs may have replaced its relocation with
+   one in ss->new_relocs, which carries the offset in its addend; see
+   sort_new_relocs.  Returns NULL if there is no relocation at addr. */
+static struct supersect *read_finalized_pointer(struct supersect *ss,
+						const void *addr,
+						bfd_vma *offsetp)
+{
+	arelent key, *keyp = &key, **relocp;
+	key.address = addr_offset(ss, addr);
+	relocp = bsearch(&keyp, ss->new_relocs.data, ss->new_relocs.size,
+			 sizeof(*ss->new_relocs.data), compare_reloc_addresses);
+
+	asymbol **symp;
+	if (relocp != NULL) {
+		symp = (*relocp)->sym_ptr_ptr;
+		*offsetp = (*relocp)->addend;
+	} else {
+		arelent *reloc = find_reloc(ss, addr);
+		if (reloc == NULL)
+			return NULL;
+		symp = reloc->sym_ptr_ptr;
+		*offsetp = reloc_offset(ss, reloc);
+	}
+
+	struct supersect *data_ss;
+	for (data_ss = ss->parent->new_supersects; data_ss != NULL;
+	     data_ss = data_ss->next) {
+		if (symp == &data_ss->symbol)
+			return data_ss;
+	}
+	assert(!bfd_is_const_section((*symp)->section));
+	*offsetp += (*symp)->value;
+	return fetch_supersect(ss->parent, (*symp)->section);
+}
+
+static void read_ksplice_relocs(struct supersect *kreloc_ss,
+				struct encoded_reloc_vec *erelocs,
+				struct ksplice_reloc_howto_vec *khowtos,
+				struct ulong_hash *khowto_index)
+{
+	const struct ksplice_reloc *kreloc;
+	for (kreloc = kreloc_ss->contents.data;
+	     (void *)kreloc < kreloc_ss->contents.data +
+	     kreloc_ss->contents.size; kreloc++) {
+		struct encoded_reloc *ereloc = vec_grow(erelocs, 1);
+		bfd_vma offset;
+
+		ereloc->ss = read_finalized_pointer(kreloc_ss,
+						    &kreloc->blank_addr,
+						    &ereloc->offset);
+		assert(ereloc->ss != NULL && ereloc->ss->keep);
+
+		struct supersect *ksymbol_ss =
+		    read_finalized_pointer(kreloc_ss, &kreloc->symbol, &offset);
+		assert(ksymbol_ss != NULL &&
+		       strcmp(ksymbol_ss->name, ".ksplice_symbols") == 0);
+		assert(offset % sizeof(struct ksplice_symbol) == 0);
+		ereloc->symbol = offset / sizeof(struct ksplice_symbol);
+
+		struct supersect *khowto_ss =
+		    read_finalized_pointer(kreloc_ss, &kreloc->howto, &offset);
+		assert(khowto_ss != NULL);
+		const struct ksplice_reloc_howto *khowto =
+		    khowto_ss->contents.data + offset;
+		char *key = strprintf("%d %d %d %lx %u %d", khowto->type,
+				      khowto->pcrel, khowto->size,
+				      khowto->dst_mask, khowto->rightshift,
+				      khowto->signed_addend);
+		unsigned long *indexp =
+		    ulong_hash_lookup(khowto_index, key, FALSE);
+		if (indexp == NULL) {
+			indexp = ulong_hash_lookup(khowto_index, key, TRUE);
+			*indexp = khowtos->size;
+			*vec_grow(khowtos, 1) = *khowto;
+		}
+		arena_free(key, strlen(key) + 1);
+		ereloc->howto = *indexp;
+		ereloc->size = khowto->size;
+
+		ereloc->insn_addend = kreloc->insn_addend;
+		ereloc->target_addend = kreloc->target_addend;
+	}
+}
+
+static void discard_section(struct supersect *ss)
+{
+	struct span *span;
+	for (span = ss->spans.data; span < ss->spans.data + ss->spans.size;
+	     span++)
+		span->keep = false;
+	ss->keep = false;
+}
+
+struct sort_entry {
+	struct supersect *ss;
+	bfd_vma offset;
+	const char *key;
+};
+DECLARE_VEC_TYPE(struct sort_entry, sort_entry_vec);
+
+static int compare_sort_entries(const void *aptr, const void *bptr)
+{
+	const struct sort_entry *a = aptr, *b = bptr;
+	int cmp = strcmp(a->key, b->key);
+	if (cmp == 0)
+		cmp = strcmp(a->ss->name, b->ss->name);
+	if (cmp == 0 && a->offset != b->offset)
+		cmp = a->offset < b->offset ? -1 : 1;
+	return cmp;
+}
+
+static const char *read_finalized_string(struct supersect *ss,
+					 const char *const *addr)
+{
+	bfd_vma offset;
+	struct supersect *str_ss = read_finalized_pointer(ss, addr, &offset);
+	if (str_ss == NULL)
+		return NULL;
+	return str_ss->contents.data + offset;
+}
+
+/* Copy the relocations in [start, start + size) of relocs, which must be
+   sorted, to dest_relocs, moving them to dest_start */
+static void copy_entry_relocs(struct arelentp_vec *dest_relocs,
+			      struct arelentp_vec *relocs, bfd_vma start,
+			      bfd_vma size, bfd_vma dest_start)
+{
+	size_t lo = 0, hi = relocs->size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (relocs->data[mid]->address < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < relocs->size && relocs->data[lo]->address < start + size;
+	     lo++) {
+		arelent *reloc = arena_alloc(sizeof(*reloc));
+		*reloc = *relocs->data[lo];
+		reloc->address += dest_start - start;
+		*vec_grow(dest_relocs, 1) = reloc;
 	}
 }
 
-static void write_ksplice_table_reloc(struct supersect *ss,
-				      unsigned long address,
-				      const char *label,
-				      enum ksplice_reloc_howto_type type)
+/* Append the entries to dest_ss sorted by key, along with their
+   relocations, which must be sorted in each source section */
+static void write_sorted_entries(struct supersect *dest_ss,
+				 struct sort_entry_vec *entries,
+				 size_t entry_size, int alignment)
 {
-	struct supersect *kreloc_ss;
-	kreloc_ss = make_section(ss->parent, ".ksplice_relocs%s", ss->name);
-	struct ksplice_reloc *kreloc = sect_grow(kreloc_ss, 1,
-						 struct ksplice_reloc);
-	struct span *span = find_span(ss, address);
-	assert(span != NULL);
+	qsort(entries->data, entries->size, sizeof(*entries->data),
+	      compare_sort_entries);
+	struct sort_entry *entry;
+	for (entry = entries->data; entry < entries->data + entries->size;
+	     entry++) {
+		void *dest = sect_do_grow(dest_ss, 1, entry_size, alignment);
+		bfd_vma dest_start = addr_offset(dest_ss, dest);
+		memcpy(dest, entry->ss->contents.data + entry->offset,
+		       entry_size);
+		copy_entry_relocs(&dest_ss->relocs, &entry->ss->relocs,
+				  entry->offset, entry_size, dest_start);
+		copy_entry_relocs(&dest_ss->new_relocs, &entry->ss->new_relocs,
+				  entry->offset, entry_size, dest_start);
+	}
+}
 
-	write_ksplice_symbol_backend(kreloc_ss, &kreloc->symbol, NULL,
-				     label, NULL);
-	write_reloc(kreloc_ss, &kreloc->blank_addr, &ss->symbol,
-		    address + span->shift);
-	write_ksplice_nonreloc_howto(kreloc_ss, &kreloc->howto, type, 0);
+/* Merge the .ksplice_sections sections into one, sorted by label so that
+   init_ksplice_mod_change need not sort them */
+static void sort_ksplice_sections(struct superbfd *sbfd)
+{
+	struct sort_entry_vec entries;
+	vec_init(&entries);
+	asection *sect;
+	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
+		struct supersect *ss = fetch_supersect(sbfd, sect);
+		if (!ss->keep || !strstarts(ss->name, ".ksplice_sections"))
+			continue;
+		sort_relocs(&ss->relocs);
+		const struct ksplice_section *ksect;
+		for (ksect = ss->contents.data;
+		     (void *)ksect < ss->contents.data + ss->contents.size;
+		     ksect++) {
+			bfd_vma offset;
+			struct supersect *ksymbol_ss =
+			    read_finalized_pointer(ss, &ksect->symbol, &offset);
+			assert(ksymbol_ss != NULL);
+			const struct ksplice_symbol *ksymbol =
+			    ksymbol_ss->contents.data + offset;
+			struct sort_entry *entry = vec_grow(&entries, 1);
+			entry->ss = ss;
+			entry->offset = addr_offset(ss, ksect);
+			entry->key = read_finalized_string(ksymbol_ss,
+							   &ksymbol->label);
+		}
+		discard_section(ss);
+	}
+	if (entries.size != 0)
+		write_sorted_entries(new_supersect(sbfd, ".ksplice_sections"),
+				     &entries, sizeof(struct ksplice_section),
+				     __alignof__(struct ksplice_section));
+	vec_free(&entries);
 }
 
-static void write_ksplice_nonreloc_howto(struct supersect *ss,
-					 const struct ksplice_reloc_howto
-					 *const *addr,
-					 enum ksplice_reloc_howto_type type,
-					 int size)
+/* Sort .ksplice_system_map by label so that init_ksplice_mod_change need
+   not sort it */
+static void sort_ksplice_system_map(struct superbfd *sbfd)
 {
-	struct supersect *khowto_ss =
-	    make_section(ss->parent, ".ksplice_reloc_howtos");
-	struct ksplice_reloc_howto *khowto =
-	    sect_grow(khowto_ss, 1, struct ksplice_reloc_howto);
+	struct supersect *smap_ss = find_section(sbfd, ".ksplice_system_map");
+	if (smap_ss == NULL || !smap_ss->keep)
+		return;
 
-	khowto->type = type;
-	khowto->size = size;
-	khowto->pcrel = 0;
-	khowto->dst_mask = 0;
-	khowto->rightshift = 0;
-	khowto->signed_addend = 0;
-	write_reloc(ss, addr, &khowto_ss->symbol,
-		    addr_offset(khowto_ss, khowto));
+	struct supersect old_ss;
+	supersect_move(&old_ss, smap_ss);
+	sort_relocs(&old_ss.relocs);
+
+	struct sort_entry_vec entries;
+	vec_init(&entries);
+	const struct ksplice_system_map *smap;
+	for (smap = old_ss.contents.data;
+	     (void *)smap < old_ss.contents.data + old_ss.contents.size;
+	     smap++) {
+		struct sort_entry *entry = vec_grow(&entries, 1);
+		entry->ss = &old_ss;
+		entry->offset = addr_offset(&old_ss, smap);
+		entry->key = read_finalized_string(&old_ss, &smap->label);
+	}
+	write_sorted_entries(smap_ss, &entries,
+			     sizeof(struct ksplice_system_map),
+			     __alignof__(struct ksplice_system_map));
+	vec_free(&entries);
+	vec_free(&old_ss.contents);
+	vec_free(&old_ss.relocs);
+	vec_free(&old_ss.new_relocs);
 }
 
-static void write_ksplice_symbol_reloc(struct supersect *ss,
-				       const char *sectname,
-				       unsigned long *addr, asymbol *sym,
-				       const char *label, const char *name)
+/* Write .ksplice_symbol_hash (see struct ksplice_symbol_hash) so that
+   the kernel can look up a finalized object's ksplice_symbols by label
+   and by name without sorting them first */
+static void write_ksplice_symbol_hash(struct superbfd *sbfd)
 {
-	struct supersect *kreloc_ss;
-	kreloc_ss = make_section(ss->parent, ".ksplice_relocs%s", sectname);
-	struct ksplice_reloc *kreloc = sect_grow(kreloc_ss, 1,
-						 struct ksplice_reloc);
+	struct supersect *ksymbol_ss = find_section(sbfd, ".ksplice_symbols");
+	const struct ksplice_symbol *ksymbols = NULL;
+	unsigned int nr_symbols = 0;
+	if (ksymbol_ss != NULL) {
+		ksymbols = ksymbol_ss->contents.data;
+		nr_symbols = ksymbol_ss->contents.size / sizeof(*ksymbols);
+	}
 
-	write_ksplice_symbol_backend(kreloc_ss, &kreloc->symbol, sym, label,
-				     name);
-	write_reloc(kreloc_ss, &kreloc->blank_addr, &ss->symbol,
-		    addr_offset(ss, addr));
-	write_ksplice_nonreloc_howto(kreloc_ss, &kreloc->howto,
-				     KSPLICE_HOWTO_SYMBOL, 0);
+	unsigned int nr_buckets = 1;
+	while (nr_buckets < nr_symbols)
+		nr_buckets *= 2;
+
+	struct supersect *hash_ss = make_section(sbfd, ".ksplice_symbol_hash");
+	struct ksplice_symbol_hash *hash =
+	    sect_grow(hash_ss, 1, struct ksplice_symbol_hash);
+	hash->nr_buckets = nr_buckets;
+	hash->nr_symbols = nr_symbols;
+	unsigned int *label_buckets =
+	    sect_grow(hash_ss, 2 * nr_buckets + 2 * nr_symbols, unsigned int);
+	unsigned int *name_buckets = label_buckets + nr_buckets;
+	unsigned int *label_next = name_buckets + nr_buckets;
+	unsigned int *name_next = label_next + nr_symbols;
+
+	unsigned int i;
+	for (i = 0; i < 2 * nr_buckets + 2 * nr_symbols; i++)
+		label_buckets[i] = KSPLICE_SYMBOL_HASH_END;
+	/* Insert backwards so each chain lists its symbols in order */
+	for (i = nr_symbols; i-- > 0;) {
+		const char *label =
+		    read_finalized_string(ksymbol_ss, &ksymbols[i].label);
+		assert(label != NULL);
+		unsigned int *bucket =
+		    &label_buckets[ksplice_string_hash(label) & (nr_buckets - 1)];
+		label_next[i] = *bucket;
+		*bucket = i;
+
+		const char *name =
+		    read_finalized_string(ksymbol_ss, &ksymbols[i].name);
+		if (name == NULL)
+			continue;
+		bucket = &name_buckets[ksplice_string_hash(name) &
+				       (nr_buckets - 1)];
+		name_next[i] = *bucket;
+		*bucket = i;
+	}
+
+	debug0(sbfd, "Hashed %u ksplice symbols into %u buckets\n",
+	       nr_symbols, nr_buckets);
+}
+
+/* Replace the .ksplice_relocs sections of a finalized object with one
+   .ksplice_reloc_table (see struct ksplice_reloc_table), which needs a
+   few bytes per Ksplice relocation and one ELF relocation per section
+   instead of 40 bytes and three ELF relocations per Ksplice relocation.
+   The table is written even if there are no relocations, since its
+   flags tell the kernel which metadata sort_ksplice_sections and
+   sort_ksplice_system_map have already put in order. */
+static void write_ksplice_reloc_table(struct superbfd *sbfd)
+{
+	struct encoded_reloc_vec erelocs;
+	struct ksplice_reloc_howto_vec khowtos;
+	struct ulong_hash khowto_index;
+	vec_init(&erelocs);
+	vec_init(&khowtos);
+	ulong_hash_init(&khowto_index);
+
+	struct supersect_vec sss;
+	vec_init(&sss);
+	asection *sect;
+	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next)
+		*vec_grow(&sss, 1) = fetch_supersect(sbfd, sect);
+	struct supersect *ss;
+	for (ss = sbfd->new_supersects; ss != NULL; ss = ss->next)
+		*vec_grow(&sss, 1) = ss;
+
+	struct supersect **ssp;
+	for (ssp = sss.data; ssp < sss.data + sss.size; ssp++) {
+		if ((*ssp)->keep && strstarts((*ssp)->name, ".ksplice_relocs"))
+			read_ksplice_relocs(*ssp, &erelocs, &khowtos,
+					    &khowto_index);
+	}
+	for (ssp = sss.data; ssp < sss.data + sss.size; ssp++) {
+		if (strstarts((*ssp)->name, ".ksplice_relocs") ||
+		    strcmp((*ssp)->name, ".ksplice_reloc_howtos") == 0)
+			discard_section(*ssp);
+	}
+	vec_free(&sss);
+	ulong_hash_free(&khowto_index);
+
+	qsort(erelocs.data, erelocs.size, sizeof(*erelocs.data),
+	      compare_encoded_relocs);
+
+	struct ksplice_reloc_run_vec runs;
+	struct supersect_vec run_sss;
+	struct byte_vec stream;
+	vec_init(&runs);
+	vec_init(&run_sss);
+	vec_init(&stream);
+
+	struct encoded_reloc *ereloc;
+	struct ksplice_reloc_run *run = NULL;
+	bfd_vma last_offset = 0;
+	size_t run_start = 0;
+	for (ereloc = erelocs.data; ereloc < erelocs.data + erelocs.size;
+	     ereloc++) {
+		if (run == NULL || ereloc->ss != run_sss.data[run_sss.size - 1]) {
+			if (run != NULL)
+				run->size = stream.size - run_start;
+			run = vec_grow(&runs, 1);
+			run->base = 0;
+			run->nr_relocs = 0;
+			*vec_grow(&run_sss, 1) = ereloc->ss;
+			run_start = stream.size;
+			last_offset = 0;
+		}
+		write_uleb128(&stream, ereloc->offset - last_offset);
+		write_uleb128(&stream, ereloc->howto);
+		write_uleb128(&stream, ereloc->symbol);
+		write_sleb128(&stream, ereloc->insn_addend);
+		write_sleb128(&stream, ereloc->target_addend);
+		last_offset = ereloc->offset;
+		run->nr_relocs++;
+	}
+	if (run != NULL)
+		run->size = stream.size - run_start;
+
+	struct supersect *table_ss = make_section(sbfd, ".ksplice_reloc_table");
+	struct ksplice_reloc_table *table =
+	    sect_grow(table_ss, 1, struct ksplice_reloc_table);
+	table->version = KSPLICE_RELOC_TABLE_VERSION;
+	table->flags = KSPLICE_SORTED_SECTIONS | KSPLICE_SORTED_SYSTEM_MAP;
+	table->nr_howtos = khowtos.size;
+	table->nr_runs = runs.size;
+	table->nr_relocs = erelocs.size;
+
+	void *buf = sect_grow(table_ss, khowtos.size,
+			      struct ksplice_reloc_howto);
+	memcpy(buf, khowtos.data, khowtos.size * sizeof(*khowtos.data));
+
+	struct ksplice_reloc_run *truns =
+	    sect_grow(table_ss, runs.size, struct ksplice_reloc_run);
+	memcpy(truns, runs.data, runs.size * sizeof(*runs.data));
+	size_t i;
+	for (i = 0; i < runs.size; i++)
+		write_reloc(table_ss, &truns[i].base, &run_sss.data[i]->symbol,
+			    0);
+
+	buf = sect_grow(table_ss, stream.size, unsigned char);
+	memcpy(buf, stream.data, stream.size);
+
+	debug0(sbfd, "Encoded %lu ksplice relocations in %lu runs into %lu "
+	       "bytes\n", (unsigned long)erelocs.size,
+	       (unsigned long)runs.size,
+	       (unsigned long)table_ss->contents.size);
+
+	vec_free(&stream);
+	vec_free(&run_sss);
+	vec_free(&runs);
+	vec_free(&khowtos);
+	vec_free(&erelocs);
 }
 
 static void write_ksplice_section(struct span *span)
@@ -1996,12 +3572,13 @@ static asymbol *name_to_symbol(struct superbfd *sbfd, const char *name)
 {
 	if (name == NULL)
 		return NULL;
+	name = intern(name);
 
 	asymbol **symp;
 	for (symp = sbfd->syms.data;
 	     symp < sbfd->syms.data + sbfd->syms.size; symp++) {
 		asymbol *sym = *symp;
-		if (strcmp(name, sym->name) == 0 &&
+		if (sym->name == name &&
 		    ((sym->flags & BSF_GLOBAL) != 0 ||
 		     bfd_is_und_section(sym->section)))
 			return sym;
@@ -2103,11 +3680,12 @@ void write_ksplice_patch(struct superbfd *sbfd, struct span *span,
 
 asymbol **make_undefined_symbolp(struct superbfd *sbfd, const char *name)
 {
+	name = intern(name);
 	asymbol **symp;
 	for (symp = sbfd->syms.data; symp < sbfd->syms.data + sbfd->syms.size;
 	     symp++) {
 		asymbol *sym = *symp;
-		if (strcmp(name, sym->name) == 0 &&
+		if (sym->name == name &&
 		    bfd_is_und_section(sym->section))
 			return symp;
 	}
@@ -2116,12 +3694,12 @@ asymbol **make_undefined_symbolp(struct superbfd *sbfd, const char *name)
 	     sympp < sbfd->new_syms.data + sbfd->new_syms.size; sympp++) {
 		asymbol **symp = *sympp;
 		asymbol *sym = *symp;
-		if (strcmp(name, sym->name) == 0 &&
+		if (sym->name == name &&
 		    bfd_is_und_section(sym->section))
 			return symp;
 	}
 
-	symp = malloc(sizeof(*symp));
+	symp = arena_alloc(sizeof(*symp));
 	*symp = bfd_make_empty_symbol(sbfd->abfd);
 	asymbol *sym = *symp;
 	sym->name = name;
@@ -2263,6 +3841,61 @@ static void match_other_spans(struct span *old_span, struct span *new_span)
 	}
 }
 
+/*
+ * match_other_spans only acts on matched pairs of spans in table
+ * sections with an other_sect, so visit just those pairs, in the
+ * order foreach_span_pair would.
+ */
+static void match_other_span_pairs(struct superbfd *oldsbfd,
+				   struct superbfd *newsbfd)
+{
+	asection *oldsect, *newsect;
+	struct supersect *oldss, *newss;
+	struct span *new_span;
+
+	struct supersect_vec other_tables;
+	vec_init(&other_tables);
+	for (oldsect = oldsbfd->abfd->sections; oldsect != NULL;
+	     oldsect = oldsect->next) {
+		oldss = fetch_supersect(oldsbfd, oldsect);
+		const struct table_section *ts = get_table_section(oldss->name);
+		if (ts != NULL && ts->other_sect != NULL)
+			*vec_grow(&other_tables, 1) = oldss;
+	}
+
+	for (newsect = newsbfd->abfd->sections; newsect != NULL;
+	     newsect = newsect->next) {
+		newss = fetch_supersect(newsbfd, newsect);
+		struct supersect **oldssp;
+		for (oldssp = other_tables.data;
+		     oldssp < other_tables.data + other_tables.size; oldssp++) {
+			oldss = *oldssp;
+			if (oldss->type != newss->type)
+				continue;
+			for (new_span = newss->spans.data;
+			     new_span < newss->spans.data + newss->spans.size;
+			     new_span++) {
+				if (new_span->match != NULL &&
+				    new_span->match->ss == oldss)
+					match_other_spans(new_span->match,
+							  new_span);
+			}
+		}
+	}
+	vec_free(&other_tables);
+}
+
+static struct span *table_entry_target_span(struct span *span,
+					    const struct table_section *ts)
+{
+	void *entry = span->ss->contents.data + span->start;
+	arelent *reloc = find_reloc(span->ss, entry + ts->addr_offset);
+	assert(reloc != NULL);
+	struct span *sym_span = reloc_target_span(span->ss, reloc);
+	assert(sym_span != NULL);
+	return sym_span;
+}
+
 static void match_table_spans(struct span *old_span, struct span *new_span)
 {
 	const struct table_section *ts = get_table_section(old_span->ss->name);
@@ -2296,6 +3929,76 @@ static void match_table_spans(struct span *old_span, struct span *new_span)
 	}
 }
 
+/*
+ * match_table_spans can only match entries of same-named table sections
+ * whose address targets are already matched to each other.  Index the
+ * old entries by their target span so that each new entry only visits
+ * those candidates, in the order foreach_span_pair would.
+ */
+static void match_table_span_pairs(struct superbfd *oldsbfd,
+				   struct superbfd *newsbfd)
+{
+	asection *oldsect, *newsect;
+	struct supersect *oldss, *newss;
+	struct span *old_span, *new_span;
+
+	for (newsect = newsbfd->abfd->sections; newsect != NULL;
+	     newsect = newsect->next) {
+		newss = fetch_supersect(newsbfd, newsect);
+		const struct table_section *ts = get_table_section(newss->name);
+		if (ts == NULL || !ts->has_addr)
+			continue;
+		for (oldsect = oldsbfd->abfd->sections; oldsect != NULL;
+		     oldsect = oldsect->next) {
+			oldss = fetch_supersect(oldsbfd, oldsect);
+			if (strcmp(oldss->name, newss->name) != 0 ||
+			    oldss->type != newss->type ||
+			    newss->type != SS_TYPE_SPECIAL)
+				continue;
+
+			struct spanp_vec_addr_hash targets;
+			spanp_vec_addr_hash_init(&targets);
+			for (old_span = oldss->spans.data;
+			     old_span < oldss->spans.data + oldss->spans.size;
+			     old_span++) {
+				if (old_span->match != NULL)
+					continue;
+				struct span *old_sym_span =
+				    table_entry_target_span(old_span, ts);
+				struct spanp_vec *cands =
+				    spanp_vec_addr_hash_lookup(&targets,
+							       old_sym_span, 0,
+							       TRUE);
+				*vec_grow(cands, 1) = old_span;
+			}
+
+			for (new_span = newss->spans.data;
+			     new_span < newss->spans.data + newss->spans.size;
+			     new_span++) {
+				if (new_span->match != NULL)
+					continue;
+				struct span *new_sym_span =
+				    table_entry_target_span(new_span, ts);
+				struct span *old_sym_span = new_sym_span->match;
+				if (old_sym_span == NULL)
+					continue;
+				struct spanp_vec *cands =
+				    spanp_vec_addr_hash_lookup(&targets,
+							       old_sym_span, 0,
+							       FALSE);
+				if (cands == NULL)
+					continue;
+				struct span **old_spanp;
+				for (old_spanp = cands->data;
+				     old_spanp < cands->data + cands->size;
+				     old_spanp++)
+					match_table_spans(*old_spanp, new_span);
+			}
+			spanp_vec_addr_hash_free(&targets);
+		}
+	}
+}
+
 static struct span *get_crc_span(struct span *span,
 				 const struct table_section *ts)
 {
@@ -2312,60 +4015,88 @@ static struct span *get_crc_span(struct span *span,
 	return crc_span;
 }
 
-void mark_precallable_spans(struct superbfd *sbfd)
+/*
+ * Mark every span reachable by relocations from a marked span, visiting
+ * each span once.  Relocations from special sections are not followed,
+ * and neither are relocations into ignored sections or into spans that
+ * are already being kept.
+ */
+static void mark_referenced_spans(struct superbfd *sbfd,
+				  bool (*marked)(struct span *span),
+				  void (*mark)(struct span *span))
 {
+	struct spanp_vec queue;
+	vec_init(&queue);
+
 	asection *sect;
-	struct supersect *ss, *sym_ss;
-	struct span *address_span, *target_span;
 	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
-		ss = fetch_supersect(sbfd, sect);
-		arelent **relocp;
+		struct supersect *ss = fetch_supersect(sbfd, sect);
+		struct span *span;
+		for (span = ss->spans.data;
+		     span < ss->spans.data + ss->spans.size; span++) {
+			if (marked(span))
+				*vec_grow(&queue, 1) = span;
+		}
+	}
+
+	size_t head;
+	for (head = 0; head < queue.size; head++) {
+		struct span *address_span = queue.data[head];
+		struct supersect *ss = address_span->ss;
 		if (ss->type == SS_TYPE_SPECIAL)
 			continue;
-		for (relocp = ss->relocs.data;
-		     relocp < ss->relocs.data + ss->relocs.size; relocp++) {
-			asymbol *sym = *(*relocp)->sym_ptr_ptr;
-			address_span = find_span(ss, (*relocp)->address);
-			if (!address_span->precallable)
+
+		size_t i = address_span->first_reloc;
+		size_t end = address_span->last_reloc;
+		update_span_index(ss);
+		if (ss->spans_overlap) {
+			i = 0;
+			end = ss->span_relocs.size;
+		}
+		for (; i < end; i++) {
+			arelent *reloc = span_relocs(ss)[i];
+			if (ss->spans_overlap &&
+			    find_span(ss, reloc->address) != address_span)
 				continue;
-			target_span = reloc_target_span(ss, *relocp);
-			if (target_span == NULL || target_span->keep)
+			asymbol *sym = *reloc->sym_ptr_ptr;
+			struct span *target_span = reloc_target_span(ss, reloc);
+			if (target_span == NULL || target_span->keep ||
+			    marked(target_span))
 				continue;
-			sym_ss = fetch_supersect(sbfd, sym->section);
+			struct supersect *sym_ss =
+			    fetch_supersect(sbfd, sym->section);
 			if (sym_ss->type == SS_TYPE_IGNORED)
 				continue;
-			target_span->precallable = true;
-			changed = true;
+			mark(target_span);
+			*vec_grow(&queue, 1) = target_span;
 		}
 	}
+	vec_free(&queue);
+}
+
+static bool span_is_precallable(struct span *span)
+{
+	return span->precallable;
+}
+
+static void mark_precallable(struct span *span)
+{
+	span->precallable = true;
+}
+
+void mark_precallable_spans(struct superbfd *sbfd)
+{
+	mark_referenced_spans(sbfd, span_is_precallable, mark_precallable);
+}
+
+static bool span_is_kept(struct span *span)
+{
+	return span->keep;
 }
 
 void keep_referenced_sections(struct superbfd *sbfd)
 {
-	asection *sect;
-	struct supersect *ss, *sym_ss;
-	struct span *address_span, *target_span;
-	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
-		ss = fetch_supersect(sbfd, sect);
-		arelent **relocp;
-		if (ss->type == SS_TYPE_SPECIAL)
-			continue;
-		for (relocp = ss->relocs.data;
-		     relocp < ss->relocs.data + ss->relocs.size; relocp++) {
-			asymbol *sym = *(*relocp)->sym_ptr_ptr;
-			address_span = find_span(ss, (*relocp)->address);
-			if (!address_span->keep)
-				continue;
-			target_span = reloc_target_span(ss, *relocp);
-			if (target_span == NULL || target_span->keep)
-				continue;
-			sym_ss = fetch_supersect(sbfd, sym->section);
-			if (sym_ss->type == SS_TYPE_IGNORED)
-				continue;
-			keep_span(target_span);
-			changed = true;
-		}
-	}
+	mark_referenced_spans(sbfd, span_is_kept, keep_span);
 }
 
 void copy_symbols(struct asymbolp_vec *osyms, struct asymbolpp_vec *isyms)
@@ -2412,8 +4143,10 @@ bfd_boolean copy_object(bfd *ibfd, bfd *obfd)
 	   section.  */
 
 	bfd_map_over_sections(ibfd, mark_symbols_used_in_relocations, NULL);
-	for (ss = new_supersects; ss != NULL; ss = ss->next)
-		ss_mark_symbols_used_in_relocations(ss);
+	for (ss = new_supersects; ss != NULL; ss = ss->next) {
+		if (ss->keep)
+			ss_mark_symbols_used_in_relocations(ss);
+	}
 	struct asymbolp_vec osyms;
 	vec_init(&osyms);
 	filter_symbols(ibfd, obfd, &osyms, &fetch_superbfd(ibfd)->syms);
@@ -2467,6 +4200,9 @@ void setup_section(bfd *ibfd, asection *isection, void *obfdarg)
 
 void setup_new_section(bfd *obfd, struct supersect *ss)
 {
+	if (!ss->keep)
+		return;
+
 	asection *osection = bfd_make_section_anyway(obfd, ss->name);
 	assert(osection != NULL);
 	bfd_set_section_flags(obfd, osection, ss->flags);
@@ -2494,6 +4230,7 @@ static void delete_obsolete_relocs(struct supersect *ss)
 	if (ss->new_relocs.size == 0)
 		return;
 
+	vec_init(&ss->span_relocs);
 	qsort(ss->relocs.data, ss->relocs.size, sizeof(*ss->relocs.data),
 	      compare_reloc_addresses);
 	qsort(ss->new_relocs.data, ss->new_relocs.size,
@@ -2923,7 +4660,7 @@ static void init_label_map(struct superbfd *sbfd)
 			continue;
 		char *key = strprintf("%p", csym);
 		asymbol **csymp = symbol_hash_lookup(&csyms, key, TRUE);
-		free(key);
+		arena_free(key, strlen(key) + 1);
 		if (*csymp != NULL)
 			continue;
 		*csymp = csym;
@@ -2947,17 +4684,16 @@ static void init_label_map(struct superbfd *sbfd)
 
 		struct label_map *first_map = *mapp;
 		if (first_map->count == 0)
-			first_map->label = strprintf("%s~%d", map->label, 0);
-		map->label = strprintf("%s~%d", map->label, ++first_map->count);
+			first_map->label = internf("%s~%d", map->label, 0);
+		map->label = internf("%s~%d", map->label, ++first_map->count);
 	}
 
-	label_mapp_hash_init(&sbfd->maps_hash);
+	label_mapp_addr_hash_init(&sbfd->maps_hash);
 	for (map = sbfd->maps.data;
 	     map < sbfd->maps.data + sbfd->maps.size; map++) {
-		char *key = strprintf("%p", map->csym);
 		struct label_map **mapp =
-		    label_mapp_hash_lookup(&sbfd->maps_hash, key, TRUE);
-		free(key);
+		    label_mapp_addr_hash_lookup(&sbfd->maps_hash, map->csym, 0,
+						TRUE);
 		*mapp = map;
 		map->orig_label = map->label;
 	}
@@ -2966,10 +4702,8 @@ static void init_label_map(struct superbfd *sbfd)
 static const char *label_lookup(struct superbfd *sbfd, asymbol *sym)
 {
 	asymbol *csym = canonical_symbol(sbfd, sym);
-	char *key = strprintf("%p", csym);
 	struct label_map **mapp =
-	    label_mapp_hash_lookup(&sbfd->maps_hash, key, FALSE);
-	free(key);
+	    label_mapp_addr_hash_lookup(&sbfd->maps_hash, csym, 0, FALSE);
 	if (mapp == NULL)
 		DIE;
 	return (*mapp)->label;
@@ -2983,7 +4717,7 @@ static void print_label_changes(struct superbfd *sbfd)
 		struct supersect *ss = fetch_supersect(sbfd, sect);
 		for (span = ss->spans.data;
 		     span < ss->spans.data + ss->spans.size; span++) {
-			if (strcmp(span->label, span->orig_label) != 0)
+			if (span->label != span->orig_label)
 				debug1(sbfd, "Label change: %s -> %s\n",
 				       span->label, span->orig_label);
 		}
@@ -2996,9 +4730,9 @@ static void label_map_set(struct superbfd *sbfd, const char *oldlabel,
 	struct label_map *map;
 	for (map = sbfd->maps.data;
 	     map < sbfd->maps.data + sbfd->maps.size; map++) {
-		if (strcmp(map->orig_label, oldlabel) == 0) {
-			if (strcmp(map->orig_label, map->label) != 0 &&
-			    strcmp(map->label, label) != 0)
+		if (map->orig_label == oldlabel) {
+			if (map->orig_label != map->label &&
+			    map->label != label)
 				DIE;
 			map->label = label;
 			return;
@@ -3014,10 +4748,9 @@ static void change_initial_label(struct span *span, const char *label)
 	span->orig_label = label;
 	if (span->symbol) {
 		asymbol *csym = canonical_symbol(sbfd, span->symbol);
-		char *key = strprintf("%p", csym);
 		struct label_map **mapp =
-		    label_mapp_hash_lookup(&sbfd->maps_hash, key, FALSE);
-		free(key);
+		    label_mapp_addr_hash_lookup(&sbfd->maps_hash, csym, 0,
+						FALSE);
 		assert(mapp);
 		(*mapp)->label = span->label;
 		(*mapp)->orig_label = span->orig_label;
@@ -3027,7 +4760,7 @@ static void change_initial_label(struct span *span, const char *label)
 
 static void init_callers(struct superbfd *sbfd)
 {
-	string_hash_init(&sbfd->callers);
+	string_addr_hash_init(&sbfd->callers);
 	asection *sect;
 	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(sbfd, sect);
@@ -3035,13 +4768,15 @@ static void init_callers(struct superbfd *sbfd)
 		for (relocp = ss->relocs.data;
 		     relocp < ss->relocs.data + ss->relocs.size; relocp++) {
 			asymbol *sym = *(*relocp)->sym_ptr_ptr;
+			if (bfd_is_const_section(sym->section))
+				continue;
+			struct supersect *sym_ss =
+			    fetch_supersect(sbfd, sym->section);
 			unsigned long val =
 			    sym->value + reloc_target_offset(ss, *relocp);
-			char *key = strprintf("%s+%lx", sym->section->name,
-					      val);
-			const char **ret = string_hash_lookup(&sbfd->callers,
-							      key, TRUE);
-			free(key);
+			const char **ret =
+			    string_addr_hash_lookup(&sbfd->callers, sym_ss,
+						    val, TRUE);
 			asymbol *csym = canonical_symbol(sbfd, sect->symbol);
 			if (*ret != NULL)
 				*ret = "*multiple_callers*";
@@ -3055,10 +4790,8 @@ static void init_callers(struct superbfd *sbfd)
 
 static const char *find_caller(struct supersect *ss, asymbol *sym)
 {
-	char *key = strprintf("%s+%lx", sym->section->name,
-			      (unsigned long)sym->value);
-	const char **ret = string_hash_lookup(&ss->parent->callers, key, FALSE);
-	free(key);
+	const char **ret = string_addr_hash_lookup(&ss->parent->callers, ss,
+						   sym->value, FALSE);
 
 	if (ret == NULL)
 		return "*no_caller*";
@@ -3067,7 +4800,7 @@ static const char *find_caller(struct supersect *ss, asymbol *sym)
 
 static void init_csyms(struct superbfd *sbfd)
 {
-	asymbolpp_hash_init(&sbfd->csyms);
+	asymbolpp_addr_hash_init(&sbfd->csyms);
 
 	asymbol **symp;
 	for (symp = sbfd->syms.data; symp < sbfd->syms.data + sbfd->syms.size;
@@ -3075,11 +4808,13 @@ static void init_csyms(struct superbfd *sbfd)
 		asymbol *sym = *symp;
 		if ((sym->flags & BSF_DEBUGGING) != 0)
 			continue;
-		char *key = strprintf("%s+%lx", sym->section->name,
-				      (unsigned long)sym->value);
-		asymbol ***csympp = asymbolpp_hash_lookup(&sbfd->csyms, key,
-							  TRUE);
-		free(key);
+		/* canonical_symbolp never scans the constant sections */
+		if (bfd_is_const_section(sym->section))
+			continue;
+		struct supersect *ss = fetch_supersect(sbfd, sym->section);
+		asymbol ***csympp = asymbolpp_addr_hash_lookup(&sbfd->csyms, ss,
+							       sym->value,
+							       TRUE);
 		if (*csympp == NULL) {
 			*csympp = symp;
 			continue;
@@ -3094,10 +4829,8 @@ static void init_csyms(struct superbfd *sbfd)
 
 static asymbol **symbolp_scan(struct supersect *ss, bfd_vma value)
 {
-	char *key = strprintf("%s+%lx", ss->name, (unsigned long)value);
 	asymbol ***csympp =
-	    asymbolpp_hash_lookup(&ss->parent->csyms, key, FALSE);
-	free(key);
+	    asymbolpp_addr_hash_lookup(&ss->parent->csyms, ss, value, FALSE);
 	if (csympp != NULL)
 		return *csympp;
 
@@ -3110,15 +4843,8 @@ static asymbol **symbolp_scan(struct supersect *ss, bfd_vma value)
 
 static asymbol **canonical_symbolp(struct superbfd *sbfd, asymbol *sym)
 {
-	if (bfd_is_const_section(sym->section)) {
-		asymbol **csymp;
-		for (csymp = sbfd->syms.data;
-		     csymp < sbfd->syms.data + sbfd->syms.size; csymp++) {
-			if (sym == *csymp)
-				return csymp;
-		}
-		return NULL;
-	}
+	if (bfd_is_const_section(sym->section))
+		return fetch_symbolp(sbfd, sym);
 	return symbolp_scan(fetch_supersect(sbfd, sym->section), sym->value);
 }
 
@@ -3153,35 +4879,35 @@ static char *static_local_symbol(struct superbfd *sbfd, asymbol *sym)
 	return strprintf("%s<%s>", basename, caller);
 }
 
-static char *symbol_label(struct superbfd *sbfd, asymbol *sym)
+static const char *symbol_label(struct superbfd *sbfd, asymbol *sym)
 {
 	const char *filename = sbfd->abfd->filename;
 	char *c = strstr(filename, ".KSPLICE");
 	int flen = (c == NULL ? strlen(filename) : c - filename);
 
-	char *label;
+	const char *label;
 	if (bfd_is_und_section(sym->section) || (sym->flags & BSF_GLOBAL) != 0) {
-		label = strdup(sym->name);
+		label = intern(sym->name);
 	} else if (bfd_is_const_section(sym->section)) {
-		label = strprintf("%s<%.*s>", sym->name, flen, filename);
+		label = internf("%s<%.*s>", sym->name, flen, filename);
 	} else {
 		asymbol *gsym = canonical_symbol(sbfd, sym);
 
 		if (gsym == NULL)
-			label = strprintf("%s+%lx<%.*s>",
-					  sym->section->name,
-					  (unsigned long)sym->value,
-					  flen, filename);
+			label = internf("%s+%lx<%.*s>",
+					sym->section->name,
+					(unsigned long)sym->value,
+					flen, filename);
 		else if ((gsym->flags & BSF_GLOBAL) != 0)
-			label = strdup(gsym->name);
+			label = intern(gsym->name);
 		else if (static_local_symbol(sbfd, gsym))
-			label = strprintf("%s+%lx<%.*s>",
-					  static_local_symbol(sbfd, gsym),
-					  (unsigned long)sym->value,
-					  flen, filename);
+			label = internf("%s+%lx<%.*s>",
+					static_local_symbol(sbfd, gsym),
+					(unsigned long)sym->value,
+					flen, filename);
 		else
-			label = strprintf("%s<%.*s>",
-					  gsym->name, flen, filename);
+			label = internf("%s<%.*s>",
+					gsym->name, flen, filename);
 	}
 
 	return label;
@@ -3212,6 +4938,11 @@ static struct span *new_span(struct supersect *ss, bfd_vma start, bfd_vma size)
 	span->match = NULL;
 	vec_init(&span->entry_points);
 	span->shift = 0;
+	span->first_reloc = SIZE_MAX;
+	span->last_reloc = SIZE_MAX;
+	span->hashed = false;
+	vec_init(&span->reloc_mask);
+	span->nonrelocs_checked = NULL;
 	asymbol **symp = symbolp_scan(ss, span->start);
 	if (symp != NULL) {
 		span->symbol = *symp;
@@ -3220,8 +4951,8 @@ static struct span *new_span(struct supersect *ss, bfd_vma start, bfd_vma size)
 		span->symbol = NULL;
 		const char *label = label_lookup(ss->parent, ss->symbol);
 		if (span->start != 0)
-			span->label = strprintf("%s<span:%lx>", label,
-						(unsigned long)span->start);
+			span->label = internf("%s<span:%lx>", label,
+					      (unsigned long)span->start);
 		else
 			span->label = label;
 	}
@@ -3304,8 +5035,9 @@ static void initialize_table_spans(struct superbfd *sbfd,
 			unsigned long val = sym->value +
 			    reloc_target_offset(ss, reloc) -
 			    (target_span->start + target_span->shift);
-			char *label = strprintf("%s<target:%s+%lx>", ss->name,
-						target_span->label, val);
+			const char *label = internf("%s<target:%s+%lx>",
+						    ss->name,
+						    target_span->label, val);
 			change_initial_label(span, label);
 		}
 
@@ -3327,7 +5059,8 @@ static void initialize_table_spans(struct superbfd *sbfd,
 		if (ss->type == SS_TYPE_EXPORT) {
 			const char *symname = read_string(ss, entry +
 							  s->other_offset);
-			char *label = strprintf("%s:%s", ss->name, symname);
+			const char *label = internf("%s:%s", ss->name,
+						    symname);
 			change_initial_label(span, label);
 		}
 	}
@@ -3419,6 +5152,11 @@ struct span *reloc_target_span(struct supersect *ss, arelent *reloc)
 	struct supersect *sym_ss =
 	    fetch_supersect(ss->parent, sym_ptr->section);
 	struct span *span, *target_span = sym_ss->spans.data;
+	update_span_index(sym_ss);
+	if (!sym_ss->spans_overlap) {
+		span = lookup_span_index(sym_ss, addend);
+		return span != NULL ? span : target_span;
+	}
 	for (span = sym_ss->spans.data;
 	     span < sym_ss->spans.data + sym_ss->spans.size; span++) {
 		if (addend >= span->start && addend < span->start + span->size)
@@ -3447,14 +5185,95 @@ static bfd_vma reloc_target_offset(struct supersect *ss, arelent *reloc)
 	return offset;
 }
 
+static struct supersect *span_index_ss;
+
+static int compare_span_indices(const void *va, const void *vb)
+{
+	const unsigned long *a = va, *b = vb;
+	const struct span *span_a = span_index_ss->spans.data + *a;
+	const struct span *span_b = span_index_ss->spans.data + *b;
+	if (span_a->start != span_b->start)
+		return span_a->start < span_b->start ? -1 : 1;
+	if (*a != *b)
+		return *a < *b ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Bring ss->span_index, the indices of ss's spans sorted by start
+ * address, up to date with ss->spans.  Spans are almost always created
+ * in address order, in which case this just appends the new ones.
+ */
+static void update_span_index(struct supersect *ss)
+{
+	struct ulong_vec *index = &ss->span_index;
+	if (index->size == ss->spans.size)
+		return;
+
+	bool sorted = true;
+	unsigned long i, first_new = index->size;
+	for (i = index->size; i < ss->spans.size; i++) {
+		if (index->size > 0) {
+			struct span *last =
+			    &ss->spans.data[index->data[index->size - 1]];
+			if (ss->spans.data[i].start < last->start)
+				sorted = false;
+		}
+		*vec_grow(index, 1) = i;
+	}
+	if (!sorted) {
+		span_index_ss = ss;
+		qsort(index->data, index->size, sizeof(*index->data),
+		      compare_span_indices);
+		ss->spans_overlap = false;
+		first_new = 0;
+	}
+
+	for (i = first_new > 0 ? first_new : 1; i < index->size; i++) {
+		struct span *prev = &ss->spans.data[index->data[i - 1]];
+		struct span *span = &ss->spans.data[index->data[i]];
+		if (prev->start + prev->size > span->start) {
+			ss->spans_overlap = true;
+			break;
+		}
+	}
+}
+
+/* Binary search for the span containing address; spans must not overlap */
+static struct span *lookup_span_index(struct supersect *ss, bfd_vma address)
+{
+	unsigned long *index = ss->span_index.data;
+	size_t lo = 0, hi = ss->span_index.size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ss->spans.data[index[mid]].start <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	struct span *span = &ss->spans.data[index[lo - 1]];
+	if (address >= span->start && address < span->start + span->size)
+		return span;
+	return NULL;
+}
+
 struct span *find_span(struct supersect *ss, bfd_size_type address)
 {
 	struct span *span;
-	for (span = ss->spans.data; span < ss->spans.data + ss->spans.size;
-	     span++) {
-		if (address >= span->start &&
-		    address < span->start + span->size)
+	update_span_index(ss);
+	if (!ss->spans_overlap) {
+		span = lookup_span_index(ss, address);
+		if (span != NULL)
 			return span;
+	} else {
+		for (span = ss->spans.data;
+		     span < ss->spans.data + ss->spans.size; span++) {
+			if (address >= span->start &&
+			    address < span->start + span->size)
+				return span;
+		}
 	}
 	/* Deal with empty BSS sections */
 	if (ss->contents.size == 0 && ss->spans.size > 0)
@@ -3491,6 +5310,7 @@ void remove_unkept_spans(struct superbfd *sbfd)
 	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
 		struct supersect *ss = fetch_supersect(sbfd, sect);
 		delete_obsolete_relocs(ss);
+		vec_init(&ss->span_relocs);
 		struct arelentp_vec orig_relocs;
 		vec_move(&orig_relocs, &ss->relocs);
 		arelent **relocp, *reloc;
@@ -3514,7 +5334,8 @@ void remove_unkept_spans(struct superbfd *sbfd)
 				DIE;
 			}
 			if (span != NULL && span->keep) {
-				arelent *new_reloc = malloc(sizeof(*new_reloc));
+				arelent *new_reloc =
+				    arena_alloc(sizeof(*new_reloc));
 				*new_reloc = *reloc;
 				new_reloc->addend = reloc_offset(ss, reloc);
 				new_reloc->addend += span->shift;
@@ -3529,6 +5350,7 @@ void remove_unkept_spans(struct superbfd *sbfd)
 			continue;
 		supersect_move(&orig_ss, ss);
 		vec_init(&ss->spans);
+		vec_init(&ss->span_index);
 		for (span = orig_ss.spans.data;
 		     span < orig_ss.spans.data + orig_ss.spans.size; span++) {
 			if (!span->keep)
@@ -3537,6 +5359,11 @@ void remove_unkept_spans(struct superbfd *sbfd)
 			*new_span = *span;
 			new_span->start = span->start + span->shift;
 			new_span->shift = 0;
+			new_span->first_reloc = SIZE_MAX;
+			new_span->last_reloc = SIZE_MAX;
+			new_span->hashed = false;
+			vec_init(&new_span->reloc_mask);
+			new_span->nonrelocs_checked = NULL;
 			sect_copy(ss, sect_do_grow(ss, 1, span->size, 1),
 				  &orig_ss, orig_ss.contents.data + span->start,
 				  span->size);
@@ -3544,11 +5371,90 @@ void remove_unkept_spans(struct superbfd *sbfd)
 	}
 }
 
+static int compare_relocs_by_address(const void *aptr, const void *bptr)
+{
+	const arelent *const *a = aptr, *const *b = bptr;
+	if ((*a)->address != (*b)->address)
+		return (*a)->address < (*b)->address ? -1 : 1;
+	/* bfd_canonicalize_reloc returns relocations in an array */
+	if (*a != *b)
+		return *a < *b ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Copy each section's relocations into ss->span_relocs, sorted by
+ * address, and record in each span the first run of them that falls
+ * within it.  ss->relocs keeps its order, so later passes that reorder
+ * or rebuild it cannot silently invalidate the spans' ranges.
+ */
+static void init_span_relocs(struct superbfd *sbfd)
+{
+	asection *sect;
+	for (sect = sbfd->abfd->sections; sect != NULL; sect = sect->next) {
+		struct supersect *ss = fetch_supersect(sbfd, sect);
+		size_t i, n = ss->relocs.size;
+		vec_init(&ss->span_relocs);
+		vec_resize(&ss->span_relocs, n);
+		arelent **relocs = ss->span_relocs.data;
+		if (n > 0)
+			memcpy(relocs, ss->relocs.data, n * sizeof(*relocs));
+		for (i = 1; i < n; i++) {
+			if (relocs[i - 1]->address > relocs[i]->address) {
+				qsort(relocs, n, sizeof(*relocs),
+				      compare_relocs_by_address);
+				break;
+			}
+		}
+
+		/* Relocations do not overlap unless they share an address */
+		bfd_vma end = 0;
+		for (i = 0; i < n; i++) {
+			if (i > 0 && relocs[i]->address != relocs[i - 1]->address)
+				assert(end <= relocs[i]->address);
+			bfd_vma reloc_end = relocs[i]->address +
+			    bfd_get_reloc_size(relocs[i]->howto);
+			if (reloc_end > end)
+				end = reloc_end;
+		}
+
+		struct span *span;
+		for (span = ss->spans.data;
+		     span < ss->spans.data + ss->spans.size; span++) {
+			span->first_reloc = SIZE_MAX;
+			span->last_reloc = SIZE_MAX;
+		}
+		for (i = 0; i < n; i++) {
+			span = find_span(ss, relocs[i]->address);
+			if (span == NULL || span->first_reloc != SIZE_MAX)
+				continue;
+			span->first_reloc = i;
+			while (i + 1 < n &&
+			       find_span(ss, relocs[i + 1]->address) == span)
+				i++;
+			span->last_reloc = i + 1;
+		}
+	}
+}
+
+/*
+ * The array that span->first_reloc and span->last_reloc index.  It is
+ * dropped whenever ss->relocs is rebuilt; catch any user that still
+ * holds a range into the old relocations.
+ */
+static arelent **span_relocs(struct supersect *ss)
+{
+	assert(ss->span_relocs.size == ss->relocs.size);
+	return ss->span_relocs.data;
+}
+
 static void init_objmanip_superbfd(struct superbfd *sbfd)
 {
+	init_syms_by_name(sbfd);
 	init_label_map(sbfd);
 	initialize_supersect_types(sbfd);
 	initialize_spans(sbfd);
+	init_span_relocs(sbfd);
 	load_options(sbfd);
 	compute_entry_points(sbfd);
 }